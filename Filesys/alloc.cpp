@@ -0,0 +1,422 @@
+#include "alloc.h"
+#include "helper.h"
+
+static const uint32_t ALLOC_GROUP_WORDS = FS_ALLOC_GROUP_BLOCKS / 64;
+
+/*
+ *  Free blocks of every allocation group, kept next to the bitmap so that full groups are skipped
+ *  without reading their words
+ */
+static std::unique_ptr<std::atomic<uint32_t>[]> group_free_blocks;
+static uint32_t group_count = 0;
+
+/*
+ *  Group where the search for the next directory starts, so new directories go round the disk
+ */
+static std::atomic<uint32_t> next_directory_group(0);
+
+/*
+ *  True while the on-disk bitmap is in use. It is only trusted after a clean shutdown, so changes
+ *  just mark their bitmap block dirty, and the dirty blocks are written when the bitmap is closed.
+ */
+static bool bitmap_persistent = false;
+static std::unique_ptr<std::atomic<bool>[]> bitmap_block_dirty;
+static uint32_t bitmap_blocks = 0;          // blocks of the on-disk bitmap, after its header block
+static uint32_t bitmap_header_block = 0;    // the region takes the last bitmap_blocks + 1 blocks of the disk
+
+/*
+ *  Blocks unlinked by a request are only handed out again once the writes that unlink them are on disk.
+ *  They are kept per thread until the request is done, then in write-back mode until the next flush.
+ */
+static thread_local std::vector<uint32_t> request_freed_blocks;
+static std::mutex freed_blocks_lock;
+static std::vector<uint32_t> freed_blocks;  // freed by finished requests, released by the next flush
+
+/*
+ *  Size the free-block bitmap and its on-disk region for disk_size blocks, called once at startup.
+ *  Every block starts out used until Filesystem_walk or Bitmap_region_load says otherwise.
+ */
+void Alloc_init(){
+    bitmap_words = (disk_size + 63) / 64;
+    free_block_bitmap.reset(new std::atomic<uint64_t>[bitmap_words]);
+    for (uint32_t i = 0; i < bitmap_words; i++) free_block_bitmap[i].store(0, std::memory_order_relaxed);
+    group_count = (bitmap_words + ALLOC_GROUP_WORDS - 1) / ALLOC_GROUP_WORDS;
+    group_free_blocks.reset(new std::atomic<uint32_t>[group_count]);
+    for (uint32_t i = 0; i < group_count; i++) group_free_blocks[i].store(0, std::memory_order_relaxed);
+    bitmap_blocks = (bitmap_words * sizeof(uint64_t) + FS_BLOCKSIZE - 1) / FS_BLOCKSIZE;
+    bitmap_header_block = disk_size - bitmap_blocks - 1;
+    bitmap_block_dirty.reset(new std::atomic<bool>[bitmap_blocks]);
+    for (uint32_t i = 0; i < bitmap_blocks; i++) bitmap_block_dirty[i].store(false, std::memory_order_relaxed);
+}
+
+/*
+ *  A bit of the given word changed, its on-disk bitmap block has to be written before the clean flag
+ *  The flag is only stored when it is not set yet, so a busy block costs a load per change
+ */
+static void Mark_bitmap_word(uint32_t word){
+    std::atomic<bool> &dirty = bitmap_block_dirty[word / (FS_BLOCKSIZE / sizeof(uint64_t))];
+    if (!dirty.load(std::memory_order_relaxed)) dirty.store(true, std::memory_order_relaxed);
+}
+
+/*
+ *  Write every dirty bitmap block, the caller makes sure no allocation runs concurrently
+ */
+static void Write_dirty_bitmap_blocks(){
+    const uint32_t words_per_block = FS_BLOCKSIZE / sizeof(uint64_t);
+    for (uint32_t bitmap_block = 0; bitmap_block < bitmap_blocks; bitmap_block++) {
+        if (!bitmap_block_dirty[bitmap_block].exchange(false, std::memory_order_acq_rel)) continue;
+        uint64_t data[FS_BLOCKSIZE / sizeof(uint64_t)];
+        for (uint32_t i = 0; i < words_per_block; i++) {
+            uint32_t curr_word = bitmap_block * words_per_block + i;
+            data[i] = (curr_word < bitmap_words) ? free_block_bitmap[curr_word].load(std::memory_order_acquire) : 0;
+        }
+        Cache_writeblock(bitmap_header_block + 1 + bitmap_block, data, BLOCK_DATA);
+    }
+}
+
+/*
+ *  Bits of a word were claimed (taken from free to used), keep the group count in step
+ */
+static void Claimed_in_word(uint32_t word, uint64_t claimed){
+    group_free_blocks[word / ALLOC_GROUP_WORDS].fetch_sub(__builtin_popcountll(claimed), std::memory_order_relaxed);
+    Mark_bitmap_word(word);
+}
+
+/*
+ *  Call try_word on the bitmap words in order of distance from goal: the rest of the group of goal,
+ *  the beginning of that group, then the following groups, wrapping around the disk.
+ *  Groups without free blocks are skipped. Stops as soon as try_word returns true.
+ */
+template <typename word_function_t>
+static bool Scan_words(uint32_t goal, word_function_t try_word){
+    if (goal >= disk_size) goal = 0;
+    uint32_t goal_group = goal / FS_ALLOC_GROUP_BLOCKS;
+    for (uint32_t i = 0; i < group_count; i++) {
+        uint32_t group = (goal_group + i) % group_count;
+        if (group_free_blocks[group].load(std::memory_order_relaxed) == 0) continue;
+        uint32_t first_word = group * ALLOC_GROUP_WORDS;
+        uint32_t word_count = std::min(ALLOC_GROUP_WORDS, bitmap_words - first_word);
+        uint32_t start = (i == 0) ? goal / 64 - first_word : 0;
+        for (uint32_t k = 0; k < word_count; k++) {
+            if (try_word(first_word + (start + k) % word_count)) return true;
+        }
+    }
+    return false;
+}
+
+/*
+ *  Out of space in write-back mode: flush, so that the blocks freed by finished requests are released
+ *  Returns false if there are none, the allocation then fails
+ */
+static bool Reclaim_freed_blocks(){
+    {
+        std::unique_lock<std::mutex> freed_lock(freed_blocks_lock);
+        if (freed_blocks.empty()) return false;
+    }
+    Cache_flush();
+    return true;
+}
+
+/*
+ *  Find a free disk block as close after goal as possible and mark it used.
+ *  Each bitmap word covers 64 blocks, a free block is found with a find-first-set on the word
+ *  and claimed with a compare-and-swap, so concurrent allocations never take a lock.
+ */
+uint32_t Find_free_disk_block(uint32_t goal){
+    metrics_timer_t alloc_timer(METRIC_ALLOC);
+    uint32_t block = 0;
+    auto try_word = [&](uint32_t word){
+        uint64_t bits = free_block_bitmap[word].load(std::memory_order_relaxed);
+        while (bits != 0) {
+            unsigned int bit = __builtin_ctzll(bits);
+            if (free_block_bitmap[word].compare_exchange_weak(bits, bits & ~(1ULL << bit), std::memory_order_acq_rel)) {
+                Claimed_in_word(word, 1ULL << bit);
+                block = word * 64 + bit;
+                return true;
+            }
+            /*** bits now holds the new value of the word, retry with it ***/
+        }
+        return false;
+    };
+    bool found = Scan_words(goal, try_word);
+    if (!found && Reclaim_freed_blocks()) found = Scan_words(goal, try_word);
+    if (!found) throw SysError("No free disk blocks");
+    return block;
+}
+
+/*
+ *  Find count free disk blocks as close after goal as possible, mark them used and store them in blocks.
+ *  Free bits are claimed a whole word at a time, with one compare-and-swap per word.
+ *  If the disk runs out of space, every block claimed so far is released again.
+ */
+void Find_free_disk_blocks(uint32_t goal, uint32_t count, uint32_t *blocks){
+    metrics_timer_t alloc_timer(METRIC_ALLOC);
+    uint32_t found = 0;
+    auto try_word = [&](uint32_t word){
+        uint64_t bits = free_block_bitmap[word].load(std::memory_order_relaxed);
+        while (bits != 0) {
+            /*** Take the lowest free bits of the word, as many as still needed ***/
+            uint64_t claimed = 0;
+            uint64_t remaining = bits;
+            for (uint32_t k = found; k < count && remaining != 0; k++) {
+                claimed |= remaining & (~remaining + 1);
+                remaining &= remaining - 1;
+            }
+            if (free_block_bitmap[word].compare_exchange_weak(bits, bits & ~claimed, std::memory_order_acq_rel)) {
+                Claimed_in_word(word, claimed);
+                while (claimed != 0) {
+                    blocks[found++] = word * 64 + __builtin_ctzll(claimed);
+                    claimed &= claimed - 1;
+                }
+                break;
+            }
+        }
+        return found == count;
+    };
+    Scan_words(goal, try_word);
+    if (found < count && Reclaim_freed_blocks()) Scan_words(goal, try_word);
+    if (found < count) {
+        for (uint32_t i = 0; i < found; i++) {
+            Set_disk_block_status(blocks[i], true);
+        }
+        throw SysError("No free disk blocks");
+    }
+}
+
+/*
+ *  Claim the free blocks from start on, up to max_length of them and only while they stay free
+ *  Returns the number of blocks claimed, 0 if start itself is used
+ */
+static uint32_t Claim_run(uint32_t start, uint32_t max_length){
+    uint32_t claimed = 0;
+    while (claimed < max_length && start + claimed < disk_size) {
+        uint32_t block = start + claimed;
+        uint32_t word = block / 64;
+        unsigned int bit = block % 64;
+        uint32_t limit = std::min(max_length - claimed, disk_size - block);
+        uint64_t bits = free_block_bitmap[word].load(std::memory_order_relaxed);
+        unsigned int length;
+        uint64_t mask;
+        do {
+            /*** Length of the run of free bits starting at bit ***/
+            uint64_t used_from_bit = ~(bits >> bit);
+            length = (used_from_bit == 0) ? 64 - bit : __builtin_ctzll(used_from_bit);
+            length = std::min(length, std::min(limit, 64 - bit));
+            if (length == 0) return claimed;
+            mask = (length == 64) ? ~0ULL : ((1ULL << length) - 1) << bit;
+        } while (!free_block_bitmap[word].compare_exchange_weak(bits, bits & ~mask, std::memory_order_acq_rel));
+        Claimed_in_word(word, mask);
+        claimed += length;
+        /*** The run stopped inside this word ***/
+        if (bit + length < 64) break;
+    }
+    return claimed;
+}
+
+/*
+ *  Claim a run of up to max_length contiguous free blocks and return its first block.
+ *  The run starts at goal if goal is free, so a file can grow its last extent in place,
+ *  otherwise at the first free block found after goal. length is set to the size of the run.
+ */
+uint32_t Find_free_disk_run(uint32_t goal, uint32_t max_length, uint32_t &length){
+    metrics_timer_t alloc_timer(METRIC_ALLOC);
+    if (goal < disk_size) {
+        length = Claim_run(goal, max_length);
+        if (length > 0) return goal;
+    }
+    uint32_t start = 0;
+    auto try_word = [&](uint32_t word){
+        uint64_t bits;
+        while ((bits = free_block_bitmap[word].load(std::memory_order_relaxed)) != 0) {
+            start = word * 64 + __builtin_ctzll(bits);
+            length = Claim_run(start, max_length);
+            if (length > 0) return true;
+            /*** Somebody else took the block first, look at the word again ***/
+        }
+        return false;
+    };
+    bool found = Scan_words(goal, try_word);
+    if (!found && Reclaim_freed_blocks()) found = Scan_words(goal, try_word);
+    if (!found) throw SysError("No free disk blocks");
+    return start;
+}
+
+/*
+ *  Goal for the inode of a new directory: the start of a group with at least the average number
+ *  of free blocks, trying the groups round robin. The directory contents then grow from there,
+ *  so directories spread over the disk and each keeps room next to it.
+ */
+uint32_t Find_directory_goal(){
+    uint64_t total_free = 0;
+    for (uint32_t i = 0; i < group_count; i++) total_free += group_free_blocks[i].load(std::memory_order_relaxed);
+    uint32_t start = next_directory_group.fetch_add(1, std::memory_order_relaxed) % group_count;
+    for (uint32_t i = 0; i < group_count; i++) {
+        uint32_t group = (start + i) % group_count;
+        if ((uint64_t)group_free_blocks[group].load(std::memory_order_relaxed) * group_count >= total_free) {
+            return group * FS_ALLOC_GROUP_BLOCKS;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Set the bit of a free block
+ */
+static void Release_block(uint32_t index){
+    uint64_t mask = 1ULL << (index % 64);
+    if (!(free_block_bitmap[index / 64].fetch_or(mask, std::memory_order_acq_rel) & mask)) {
+        group_free_blocks[index / FS_ALLOC_GROUP_BLOCKS].fetch_add(1, std::memory_order_relaxed);
+    }
+    Mark_bitmap_word(index / 64);
+}
+
+/* 
+ *  This function set the diskblock status
+ */
+void Set_disk_block_status(uint32_t index, bool if_free){
+    uint64_t mask = 1ULL << (index % 64);
+    if (if_free) Release_block(index);
+    else if (free_block_bitmap[index / 64].fetch_and(~mask, std::memory_order_acq_rel) & mask) {
+        group_free_blocks[index / FS_ALLOC_GROUP_BLOCKS].fetch_sub(1, std::memory_order_relaxed);
+        Mark_bitmap_word(index / 64);
+    }
+}
+
+/*
+ *  Free a block that a request unlinks from the tree. It stays used until Free_request_done,
+ *  so a crash can never leave an old pointer to it on disk next to its new contents.
+ *  Blocks claimed by a request and never linked are released with Set_disk_block_status instead.
+ */
+void Free_disk_block(uint32_t index){
+    request_freed_blocks.push_back(index);
+}
+
+/*
+ *  Called once a request has made all its writes. In write-through mode they are on disk, so the
+ *  blocks it freed are released right away, in write-back mode they wait for the next flush.
+ */
+void Free_request_done(){
+    if (request_freed_blocks.empty()) return;
+    if (!write_back_cache) {
+        for (uint32_t block : request_freed_blocks) Set_disk_block_status(block, true);
+    }
+    else {
+        std::unique_lock<std::mutex> freed_lock(freed_blocks_lock);
+        freed_blocks.insert(freed_blocks.end(), request_freed_blocks.begin(), request_freed_blocks.end());
+    }
+    request_freed_blocks.clear();
+}
+
+/*
+ *  Cache_flush takes the freed blocks when it takes its batch, which holds every write that unlinked them,
+ *  and releases them once the batch is on disk
+ */
+void Freed_blocks_take(std::vector<uint32_t> &blocks){
+    std::unique_lock<std::mutex> freed_lock(freed_blocks_lock);
+    blocks.insert(blocks.end(), freed_blocks.begin(), freed_blocks.end());
+    freed_blocks.clear();
+}
+
+/*
+ *  Runs inside Cache_flush, so nothing is written here: the bitmap blocks are only marked dirty
+ */
+void Freed_blocks_release(const std::vector<uint32_t> &blocks){
+    for (uint32_t block : blocks) Release_block(block);
+}
+
+/*
+ *  The header is written between two flushes, so that in write-back mode a clean header is only
+ *  on disk after the bitmap and an unclean one before any later change
+ */
+static void Write_bitmap_header(uint32_t clean){
+    fs_bitmap_header header[FS_BLOCKSIZE / sizeof(fs_bitmap_header)];
+    memset(header, 0, sizeof(header));
+    header[0].magic = FS_BITMAP_MAGIC;
+    header[0].clean = clean;
+    header[0].disk_size = disk_size;
+    header[0].bitmap_blocks = bitmap_blocks;
+    Cache_flush();
+    Cache_writeblock(bitmap_header_block, header, BLOCK_DATA);
+    Cache_flush();
+}
+
+static bool Block_is_free(uint32_t index){
+    return free_block_bitmap[index / 64].load() & (1ULL << (index % 64));
+}
+
+/*
+ *  Fast startup path: if the on-disk bitmap was saved by a clean shutdown, load it
+ *  instead of walking the directory tree, and mark it unclean until the next clean shutdown.
+ *  Return false if the bitmap is missing or unclean, the caller then walks the tree.
+ */
+bool Bitmap_region_load(){
+    fs_bitmap_header header[FS_BLOCKSIZE / sizeof(fs_bitmap_header)];
+    Cache_readblock(bitmap_header_block, header);
+    if (header[0].magic != FS_BITMAP_MAGIC || header[0].clean != 1) return false;
+    if (header[0].disk_size != disk_size || header[0].bitmap_blocks != bitmap_blocks) return false;
+    const uint32_t words_per_block = FS_BLOCKSIZE / sizeof(uint64_t);
+    for (uint32_t i = 0; i < bitmap_blocks; i++) {
+        uint64_t data[FS_BLOCKSIZE / sizeof(uint64_t)];
+        Cache_readblock(bitmap_header_block + 1 + i, data);
+        for (uint32_t j = 0; j < words_per_block && i * words_per_block + j < bitmap_words; j++) {
+            uint32_t word = i * words_per_block + j;
+            free_block_bitmap[word].store(data[j]);
+            group_free_blocks[word / ALLOC_GROUP_WORDS].fetch_add(__builtin_popcountll(data[j]), std::memory_order_relaxed);
+        }
+    }
+    /*** The root inode and the region itself must be in use, otherwise the bitmap cannot be trusted ***/
+    for (uint32_t i = bitmap_header_block; i < disk_size; i++) {
+        if (Block_is_free(i)) return false;
+    }
+    if (Block_is_free(0)) return false;
+    Write_bitmap_header(0);
+    bitmap_persistent = true;
+    return true;
+}
+
+/*
+ *  After a full tree walk, claim the bitmap region and write the whole bitmap to it.
+ *  If files already use the region, the on-disk bitmap stays disabled for this run.
+ */
+void Bitmap_region_attach(){
+    for (uint32_t i = bitmap_header_block; i < disk_size; i++) {
+        if (!Block_is_free(i)) {
+            TestPrint("---------- Bitmap region in use, allocation map disabled ---------- ", i);
+            return;
+        }
+    }
+    for (uint32_t i = bitmap_header_block; i < disk_size; i++) {
+        Set_disk_block_status(i, false);
+    }
+    /*** Every bitmap block is written at the clean shutdown, the header says unclean until then ***/
+    for (uint32_t i = 0; i < bitmap_blocks; i++) bitmap_block_dirty[i].store(true, std::memory_order_relaxed);
+    bitmap_persistent = true;
+    Write_bitmap_header(0);
+}
+
+/*
+ *  When running without the on-disk bitmap, a header left by an earlier run is marked
+ *  unclean so that a later run never trusts a bitmap that was not kept up to date.
+ *  This is only done if the walk found the header block unused by any file.
+ */
+void Bitmap_region_invalidate(){
+    if (!Block_is_free(bitmap_header_block)) return;
+    fs_bitmap_header header[FS_BLOCKSIZE / sizeof(fs_bitmap_header)];
+    Cache_readblock(bitmap_header_block, header);
+    if (header[0].magic != FS_BITMAP_MAGIC || header[0].clean == 0) return;
+    header[0].clean = 0;
+    Cache_writeblock(bitmap_header_block, header, BLOCK_DATA);
+    Cache_flush();
+}
+
+/*
+ *  Clean shutdown: write the dirty bitmap blocks and mark the bitmap clean so the next startup can skip the tree walk.
+ *  Must be called after every request has finished.
+ */
+void Bitmap_region_close(){
+    if (!bitmap_persistent) return;
+    /*** The flush releases the blocks freed since the last one, so their bits are written too ***/
+    Cache_flush();
+    Write_dirty_bitmap_blocks();
+    Write_bitmap_header(1);
+}
@@ -0,0 +1,55 @@
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+
+#include "global.h"
+
+/*
+ *  Optional on-disk copy of the free-block bitmap.
+ *  It lives in the last blocks of the disk: one header block followed by
+ *  enough bitmap blocks for one bit per disk block, set if free.
+ */
+static const uint32_t FS_BITMAP_MAGIC = 0x46534d50;    // "FSMP"
+
+/*
+ *  The disk is divided into allocation groups. A new directory starts in a group with plenty
+ *  of free space, and its direntry blocks, the inodes of its entries and their data are
+ *  allocated as close after it as possible, so a directory tree ages without scattering.
+ */
+static const uint32_t FS_ALLOC_GROUP_BLOCKS = 512;
+
+struct fs_bitmap_header {
+    uint32_t magic;                        // FS_BITMAP_MAGIC if the region is in use
+    uint32_t clean;                        // 1 if the bitmap was saved by a clean shutdown
+    uint32_t disk_size;                    // disk_size when the bitmap was written
+    uint32_t bitmap_blocks;                // number of bitmap blocks when the bitmap was written
+};
+
+void Alloc_init();
+
+uint32_t Find_free_disk_block(uint32_t goal);
+
+void Find_free_disk_blocks(uint32_t goal, uint32_t count, uint32_t *blocks);
+
+uint32_t Find_free_disk_run(uint32_t goal, uint32_t max_length, uint32_t &length);
+
+uint32_t Find_directory_goal();
+
+void Set_disk_block_status(uint32_t index, bool if_free);
+
+void Free_disk_block(uint32_t index);
+
+void Free_request_done();
+
+void Freed_blocks_take(std::vector<uint32_t> &blocks);
+
+void Freed_blocks_release(const std::vector<uint32_t> &blocks);
+
+bool Bitmap_region_load();
+
+void Bitmap_region_attach();
+
+void Bitmap_region_invalidate();
+
+void Bitmap_region_close();
+
+#endif /* _ALLOC_H_ */
@@ -0,0 +1,120 @@
+/*
+ * disk.cpp
+ *
+ * Stand-in for the disk of the file server, for local runs and benchmarks.
+ * It provides disk_readblock, disk_writeblock and cout_lock as declared in fs_server.h.
+ *
+ * The Makefile links the server with it into build/fs_server.
+ *
+ * Configured through the environment:
+ *     FS_DISK_FILE        back the disk with this file, kept across runs; memory only if unset
+ *     FS_DISK_READ_US     latency added to every disk_readblock, in microseconds
+ *     FS_DISK_WRITE_US    latency added to every disk_writeblock, in microseconds
+ *     FS_DISK_STATS       if set, print the number of reads and writes on exit
+ * The latency is slept outside of any lock, so concurrent I/Os overlap like on a real device.
+ */
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../fs_server.h"
+
+std::mutex cout_lock;
+
+static const unsigned int DISK_STRIPES = 64;    // independently locked groups of blocks in memory mode
+
+static std::vector<char> disk_memory;
+static std::mutex disk_stripe_lock[DISK_STRIPES];
+static int disk_fd = -1;
+static unsigned int disk_read_latency = 0;
+static unsigned int disk_write_latency = 0;
+static std::atomic<uint64_t> disk_reads(0);
+static std::atomic<uint64_t> disk_writes(0);
+
+static unsigned int Env_to_Int(const char *name){
+    const char *value = getenv(name);
+    return (value == nullptr) ? 0 : (unsigned int)strtoul(value, nullptr, 10);
+}
+
+static void Disk_report(){
+    fprintf(stderr, "@@@ disk reads %llu writes %llu\n",
+            (unsigned long long)disk_reads.load(), (unsigned long long)disk_writes.load());
+}
+
+/*
+ *  Format a new disk: everything zero except the root inode, an empty directory owned by nobody
+ */
+static void Disk_format(char *disk){
+    memset(disk, 0, (size_t)FS_DISKSIZE * FS_BLOCKSIZE);
+    fs_inode *root_inode = (fs_inode *)disk;
+    root_inode->type = 'd';
+}
+
+/*
+ *  Set up the disk before main() runs, the server reads block 0 in its own initialization
+ */
+static bool Disk_init(){
+    disk_read_latency = Env_to_Int("FS_DISK_READ_US");
+    disk_write_latency = Env_to_Int("FS_DISK_WRITE_US");
+    if (getenv("FS_DISK_STATS") != nullptr) atexit(Disk_report);
+    const char *disk_file = getenv("FS_DISK_FILE");
+    const off_t disk_bytes = (off_t)FS_DISKSIZE * FS_BLOCKSIZE;
+    if (disk_file == nullptr) {
+        disk_memory.resize(disk_bytes);
+        Disk_format(disk_memory.data());
+        return true;
+    }
+    disk_fd = open(disk_file, O_RDWR | O_CREAT, 0644);
+    assert(disk_fd != -1);
+    if (lseek(disk_fd, 0, SEEK_END) != disk_bytes) {
+        std::vector<char> disk(disk_bytes);
+        Disk_format(disk.data());
+        ssize_t written = pwrite(disk_fd, disk.data(), disk_bytes, 0);
+        assert(written == disk_bytes);
+        (void)written;
+    }
+    return true;
+}
+
+static bool disk_initialized = Disk_init();
+
+static void Disk_delay(unsigned int microseconds){
+    if (microseconds > 0) std::this_thread::sleep_for(std::chrono::microseconds(microseconds));
+}
+
+void disk_readblock(unsigned int block, void *buf){
+    assert(disk_initialized && block < FS_DISKSIZE);
+    disk_reads++;
+    Disk_delay(disk_read_latency);
+    if (disk_fd != -1) {
+        ssize_t n = pread(disk_fd, buf, FS_BLOCKSIZE, (off_t)block * FS_BLOCKSIZE);
+        assert(n == FS_BLOCKSIZE);
+        (void)n;
+        return;
+    }
+    std::lock_guard<std::mutex> stripe_lock(disk_stripe_lock[block % DISK_STRIPES]);
+    memcpy(buf, disk_memory.data() + (size_t)block * FS_BLOCKSIZE, FS_BLOCKSIZE);
+}
+
+void disk_writeblock(unsigned int block, const void *buf){
+    assert(disk_initialized && block < FS_DISKSIZE);
+    disk_writes++;
+    Disk_delay(disk_write_latency);
+    if (disk_fd != -1) {
+        ssize_t n = pwrite(disk_fd, buf, FS_BLOCKSIZE, (off_t)block * FS_BLOCKSIZE);
+        assert(n == FS_BLOCKSIZE);
+        (void)n;
+        return;
+    }
+    std::lock_guard<std::mutex> stripe_lock(disk_stripe_lock[block % DISK_STRIPES]);
+    memcpy(disk_memory.data() + (size_t)block * FS_BLOCKSIZE, buf, FS_BLOCKSIZE);
+}
@@ -0,0 +1,400 @@
+/*
+ * fs_bench.cpp
+ *
+ * Load generator for the file server.
+ * N client threads each work in their own directory tree and issue a random mix of
+ * FS_READBLOCK, FS_WRITEBLOCK, FS_CREATE and FS_DELETE requests for a fixed time,
+ * one connection per request like the client library, or with -B one binary protocol
+ * connection per client (fs_binary.h). At the end it reports the throughput and the
+ * p50/p99/p999 latency of every request type.
+ *
+ * Run against a server using the stand-in disk, after make:
+ *     FS_DISK_READ_US=100 FS_DISK_WRITE_US=100 build/fs_server 8000 &
+ *     build/fs_bench -p 8000 -c 16 -t 10 -m 70,20,5,5 -d 3
+ *
+ * To count heap allocations, build with make CPPFLAGS=-DFS_COUNT_ALLOCS and run the server
+ * with -s: every "@@@ metric" line then ends with allocs_per_op.  With -B, steady-state
+ * READ/WRITE requests make none.
+ *
+ * Usage: fs_bench -p port [-h host] [-c clients] [-t seconds] [-m read,write,create,delete]
+ *                 [-d depth] [-f files] [-b blocks] [-B]
+ *     -B  use the binary protocol over one persistent connection per client
+ *     -c  number of concurrent clients (default 8)
+ *     -t  length of the measured run in seconds (default 10)
+ *     -m  relative weights of the request types (default 70,20,5,5)
+ *     -d  directories between the root and the files of a client (default 2)
+ *     -f  files created by every client before the run (default 16)
+ *     -b  blocks written to every file before the run (default 8)
+ *
+ * The tree of a client is /cN/d1/.../f0 ...  A run can follow another one on the same disk:
+ * directories that already exist are reused, the files of the tree are created anew, and the
+ * files created during the run get names of their own.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../fs_param.h"
+#include "../fs_binary.h"
+
+#define BENCH_READ   0
+#define BENCH_WRITE  1
+#define BENCH_CREATE 2
+#define BENCH_DELETE 3
+#define BENCH_TYPES  4
+
+static const char *bench_type_names[BENCH_TYPES] = {"read", "write", "create", "delete"};
+
+struct bench_config_t {
+    const char *host = "127.0.0.1";
+    int port = 0;
+    unsigned int clients = 8;
+    unsigned int seconds = 10;
+    unsigned int weights[BENCH_TYPES] = {70, 20, 5, 5};
+    unsigned int depth = 2;
+    unsigned int files = 16;
+    unsigned int blocks = 8;
+    bool binary = false;
+};
+
+struct bench_file_t {
+    std::string path;
+    uint32_t size;                          // blocks written so far
+};
+
+/*
+ *  State and results of one client, the results are merged after the run
+ */
+struct bench_client_t {
+    unsigned int id;
+    std::string username;
+    std::string directory;                  // deepest directory, holding the files
+    std::vector<bench_file_t> files;
+    int binary_fd = -1;                     // persistent connection with -B
+    uint32_t next_request_id = 0;
+    bool ready = false;
+    std::string setup_error;                // request that failed during the setup
+    std::vector<uint64_t> latencies[BENCH_TYPES];  // nanoseconds of every successful request
+    uint64_t failures[BENCH_TYPES] = {0, 0, 0, 0};
+};
+
+static bench_config_t config;
+static struct sockaddr_in server_address;
+static std::string run_tag;                 // names the files created during this run
+
+static uint64_t Now(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ *  Send one request on a new connection and wait until the server closes it
+ *  Return true if the server replied, it closes the connection without a reply on failure
+ */
+static bool Send_request(const std::string &header, const char *data, size_t data_length){
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd == -1) return false;
+    if (connect(server_fd, (struct sockaddr *)&server_address, sizeof(server_address)) == -1) {
+        close(server_fd);
+        return false;
+    }
+    std::string message = header;
+    message.push_back('\0');
+    if (data != nullptr) message.append(data, data_length);
+    size_t sent = 0;
+    while (sent < message.length()) {
+        ssize_t n = send(server_fd, message.data() + sent, message.length() - sent, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += n;
+    }
+    size_t received = 0;
+    char buffer[FS_BLOCKSIZE + 256];
+    while (true) {
+        ssize_t n = recv(server_fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) break;
+        received += n;
+    }
+    close(server_fd);
+    return sent == message.length() && received > 0;
+}
+
+static bool Send_bytes(int fd, const char *data, size_t length){
+    while (length > 0) {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool Receive_bytes(int fd, char *data, size_t length){
+    while (length > 0) {
+        ssize_t n = recv(fd, data, length, 0);
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+/*
+ *  Send one binary request on the persistent connection of the client and wait for its response
+ *  Return true if the server answered FS_BINARY_OK
+ */
+static bool Send_binary_request(bench_client_t &client, uint8_t opcode, const std::string &path,
+                                uint32_t block, char type, const char *data){
+    if (client.binary_fd == -1) {
+        client.binary_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (client.binary_fd == -1) return false;
+        if (connect(client.binary_fd, (struct sockaddr *)&server_address, sizeof(server_address)) == -1) {
+            close(client.binary_fd);
+            client.binary_fd = -1;
+            return false;
+        }
+    }
+    fs_binary_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FS_BINARY_MAGIC;
+    header.version = FS_BINARY_VERSION;
+    header.opcode = opcode;
+    header.type = type;
+    header.username_length = client.username.length();
+    header.pathname_length = htons(path.length());
+    header.request_id = htonl(++client.next_request_id);
+    header.block = htonl(block);
+    header.count = htonl(1);
+    header.payload_length = htonl(data == nullptr ? 0 : FS_BLOCKSIZE);
+    std::string message((const char *)&header, sizeof(header));
+    message += client.username;
+    message += path;
+    if (data != nullptr) message.append(data, FS_BLOCKSIZE);
+    char buffer[FS_BLOCKSIZE];
+    bool if_sent = Send_bytes(client.binary_fd, message.data(), message.length());
+    if (if_sent && Receive_bytes(client.binary_fd, (char *)&header, sizeof(header))) {
+        uint32_t payload_length = ntohl(header.payload_length);
+        if (payload_length <= sizeof(buffer) && Receive_bytes(client.binary_fd, buffer, payload_length)
+            && ntohl(header.request_id) == client.next_request_id) {
+            return header.status == FS_BINARY_OK;
+        }
+    }
+    /*** The connection is out of sync, reconnect on the next request ***/
+    close(client.binary_fd);
+    client.binary_fd = -1;
+    return false;
+}
+
+/*
+ *  Send one request with the protocol chosen on the command line
+ */
+static bool Send_client_request(bench_client_t &client, int type, const std::string &path, uint32_t block, const char *data){
+    if (config.binary) {
+        uint8_t opcode = (type == BENCH_READ) ? FS_BINARY_READBLOCK : (type == BENCH_WRITE) ? FS_BINARY_WRITEBLOCK
+                       : (type == BENCH_CREATE) ? FS_BINARY_CREATE : FS_BINARY_DELETE;
+        return Send_binary_request(client, opcode, path, block, 'f', data);
+    }
+    std::string header;
+    if (type == BENCH_READ) header = "FS_READBLOCK " + client.username + " " + path + " " + std::to_string(block);
+    else if (type == BENCH_WRITE) header = "FS_WRITEBLOCK " + client.username + " " + path + " " + std::to_string(block);
+    else if (type == BENCH_CREATE) header = "FS_CREATE " + client.username + " " + path + " f";
+    else header = "FS_DELETE " + client.username + " " + path;
+    return Send_request(header, data, data == nullptr ? 0 : FS_BLOCKSIZE);
+}
+
+/*
+ *  Send one setup request, remembering it if it fails
+ */
+static bool Setup_request(bench_client_t &client, const std::string &header, const char *data){
+    if (Send_request(header, data, data == nullptr ? 0 : FS_BLOCKSIZE)) return true;
+    client.setup_error = header;
+    return false;
+}
+
+/*
+ *  Build the directory chain and the initial files of a client, not measured
+ *  A directory left by an earlier run is reused, a file is deleted and created again so that it
+ *  starts empty. A directory that cannot be used shows up as a failure to create what goes in it.
+ */
+static void Client_setup(bench_client_t &client){
+    char block[FS_BLOCKSIZE];
+    memset(block, 'a' + client.id % 26, FS_BLOCKSIZE);
+    client.username = "u" + std::to_string(client.id);
+    client.directory = "/c" + std::to_string(client.id);
+    Send_request("FS_CREATE " + client.username + " " + client.directory + " d", nullptr, 0);
+    for (unsigned int i = 1; i <= config.depth; i++) {
+        client.directory += "/d" + std::to_string(i);
+        Send_request("FS_CREATE " + client.username + " " + client.directory + " d", nullptr, 0);
+    }
+    for (unsigned int i = 0; i < config.files; i++) {
+        bench_file_t file = {client.directory + "/f" + std::to_string(i), 0};
+        std::string create = "FS_CREATE " + client.username + " " + file.path + " f";
+        if (!Send_request(create, nullptr, 0)) {
+            Send_request("FS_DELETE " + client.username + " " + file.path, nullptr, 0);
+            if (!Setup_request(client, create, nullptr)) return;
+        }
+        for (; file.size < config.blocks; file.size++) {
+            std::string header = "FS_WRITEBLOCK " + client.username + " " + file.path + " " + std::to_string(file.size);
+            if (!Setup_request(client, header, block)) return;
+        }
+        client.files.push_back(file);
+    }
+    client.ready = true;
+}
+
+/*
+ *  Issue random requests until the deadline, every client has its own user and files
+ *  so requests never fail because of another client
+ */
+static void Client_running(bench_client_t &client, uint64_t deadline){
+    std::mt19937_64 random(client.id);
+    std::vector<bench_file_t> &files = client.files;
+    unsigned int total_weight = 0;
+    for (unsigned int weight : config.weights) total_weight += weight;
+    unsigned int next_file = config.files;
+    char block[FS_BLOCKSIZE];
+    memset(block, 'A' + client.id % 26, FS_BLOCKSIZE);
+    while (Now() < deadline) {
+        unsigned int pick = random() % total_weight;
+        int type = 0;
+        while (pick >= config.weights[type]) pick -= config.weights[type++];
+        /*** Keep at least one file to read and write ***/
+        if (type == BENCH_DELETE && files.size() <= 1) type = BENCH_CREATE;
+        if ((type == BENCH_READ || type == BENCH_WRITE) && files.empty()) type = BENCH_CREATE;
+        std::string path;
+        uint32_t block_index = 0;
+        const char *data = nullptr;
+        size_t file_index = files.empty() ? 0 : random() % files.size();
+        if (type == BENCH_READ) {
+            bench_file_t &file = files[file_index];
+            if (file.size == 0) type = BENCH_WRITE;
+            else {
+                path = file.path;
+                block_index = random() % file.size;
+            }
+        }
+        if (type == BENCH_WRITE) {
+            bench_file_t &file = files[file_index];
+            block_index = random() % (file.size + 1);
+            if (block_index == FS_MAXFILEBLOCKS) block_index = 0;
+            path = file.path;
+            data = block;
+            if (block_index == file.size) file.size++;
+        }
+        else if (type == BENCH_CREATE) {
+            bench_file_t file = {client.directory + "/" + run_tag + std::to_string(next_file++), 0};
+            path = file.path;
+            files.push_back(file);
+        }
+        else if (type == BENCH_DELETE) {
+            path = files[file_index].path;
+            files[file_index] = files.back();
+            files.pop_back();
+        }
+        uint64_t start = Now();
+        bool if_success = Send_client_request(client, type, path, block_index, data);
+        uint64_t latency = Now() - start;
+        if (if_success) client.latencies[type].push_back(latency);
+        else client.failures[type]++;
+    }
+}
+
+static double Percentile_us(const std::vector<uint64_t> &sorted, double quantile){
+    if (sorted.empty()) return 0;
+    size_t rank = std::min(sorted.size() - 1, (size_t)(quantile * sorted.size()));
+    return sorted[rank] / 1000.0;
+}
+
+static bool Parse_weights(const char *text){
+    return sscanf(text, "%u,%u,%u,%u", &config.weights[0], &config.weights[1], &config.weights[2], &config.weights[3]) == 4
+        && config.weights[0] + config.weights[1] + config.weights[2] + config.weights[3] > 0;
+}
+
+int main(int argc, char *argv[]){
+    int option;
+    while ((option = getopt(argc, argv, "h:p:c:t:m:d:f:b:B")) != -1) {
+        if (option == 'h') config.host = optarg;
+        else if (option == 'p') config.port = atoi(optarg);
+        else if (option == 'c') config.clients = atoi(optarg);
+        else if (option == 't') config.seconds = atoi(optarg);
+        else if (option == 'm') { if (!Parse_weights(optarg)) return 1; }
+        else if (option == 'd') config.depth = atoi(optarg);
+        else if (option == 'f') config.files = atoi(optarg);
+        else if (option == 'b') config.blocks = atoi(optarg);
+        else if (option == 'B') config.binary = true;
+        else return 1;
+    }
+    if (config.port == 0 || config.clients == 0 || config.blocks > FS_MAXFILEBLOCKS) {
+        fprintf(stderr, "usage: fs_bench -p port [-h host] [-c clients] [-t seconds] [-m r,w,c,d] [-d depth] [-f files] [-b blocks] [-B]\n");
+        return 1;
+    }
+    struct hostent *host = gethostbyname(config.host);
+    if (host == nullptr) {
+        fprintf(stderr, "unknown host %s\n", config.host);
+        return 1;
+    }
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(config.port);
+    memcpy(&server_address.sin_addr, host->h_addr_list[0], host->h_length);
+
+    run_tag = "r" + std::to_string((unsigned long)time(nullptr) % 100000000) + "_" + std::to_string(getpid()) + "_";
+
+    /*** Every client builds its files first, the measured run starts once all of them are done ***/
+    std::vector<bench_client_t> clients(config.clients);
+    std::vector<std::thread> client_threads;
+    for (unsigned int i = 0; i < config.clients; i++) {
+        clients[i].id = i;
+        client_threads.emplace_back(Client_setup, std::ref(clients[i]));
+    }
+    for (std::thread &client_thread : client_threads) client_thread.join();
+    client_threads.clear();
+    for (bench_client_t &client : clients) {
+        if (!client.ready) {
+            fprintf(stderr, "client %u: setup request \"%s\" failed (disk full, or the path is used by another user?)\n",
+                    client.id, client.setup_error.c_str());
+            return 1;
+        }
+    }
+    uint64_t start = Now();
+    uint64_t deadline = start + (uint64_t)config.seconds * 1000000000ULL;
+    for (bench_client_t &client : clients) {
+        client_threads.emplace_back(Client_running, std::ref(client), deadline);
+    }
+    for (std::thread &client_thread : client_threads) client_thread.join();
+    double elapsed = (Now() - start) / 1e9;
+    for (bench_client_t &client : clients) {
+        if (client.binary_fd != -1) close(client.binary_fd);
+    }
+
+    uint64_t total = 0;
+    printf("%-8s %10s %8s %10s %10s %10s %10s\n", "type", "ops", "failed", "ops/s", "p50_us", "p99_us", "p999_us");
+    for (int type = 0; type < BENCH_TYPES; type++) {
+        std::vector<uint64_t> latencies;
+        uint64_t failures = 0;
+        for (bench_client_t &client : clients) {
+            latencies.insert(latencies.end(), client.latencies[type].begin(), client.latencies[type].end());
+            failures += client.failures[type];
+        }
+        std::sort(latencies.begin(), latencies.end());
+        total += latencies.size();
+        printf("%-8s %10zu %8llu %10.0f %10.1f %10.1f %10.1f\n", bench_type_names[type], latencies.size(),
+               (unsigned long long)failures, latencies.size() / elapsed, Percentile_us(latencies, 0.5),
+               Percentile_us(latencies, 0.99), Percentile_us(latencies, 0.999));
+    }
+    printf("total %llu ops in %.2f s, %.0f ops/s\n", (unsigned long long)total, elapsed, total / elapsed);
+    return 0;
+}
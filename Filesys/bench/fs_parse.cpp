@@ -0,0 +1,435 @@
+/*
+ * fs_parse.cpp
+ *
+ * Checks of the text request framing and parser, linked with the server sources.
+ *     limits   the longest legal headers, with a FS_MAXUSERNAME username, a FS_MAXPATHNAME
+ *              pathname and block numbers of a 2^31-block disk, are framed and parsed, their
+ *              response headers fit the response buffer, and a header with no NUL within
+ *              max_message_length + 1 bytes closes the connection
+ *     differential  Message_Parsing and a copy of the regex/istringstream parser it replaced,
+ *              with its own validation, accept and reject the same messages of a generated
+ *              corpus of the original grammar (every request type, leading zeros, double and
+ *              trailing spaces, other whitespace, overlong fields, missing and extra fields),
+ *              and fill in the same request_t fields
+ *     requests the request types added since (FS_SESSION, FS_READBLOCKS, FS_WRITEBLOCKS) against
+ *              hand-written expectations
+ *     timing   nanoseconds per message of both parsers, over the accepted and the rejected
+ *              messages of the corpus (a rejection costs a thrown SysError in both)
+ * Every failed check is printed, the exit status is 1 if there is any.
+ *
+ * make check builds and runs it.
+ *
+ * Usage: fs_parse [-n messages] [-s seed]
+ *     -n  size of the generated corpus (default 200000)
+ *     -s  seed of the corpus generator (default 1)
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <regex>
+#include <string>
+#include <unistd.h>
+
+#include "../socket.h"
+
+extern const int max_message_length;
+
+#define FRAME_DONE     0                    // the whole request was framed
+#define FRAME_PAYLOAD  1                    // the header was parsed, its data has not arrived
+#define FRAME_WAITING  2                    // the header has not ended yet
+#define FRAME_REJECTED 3                    // the connection would be closed
+
+static int failures = 0;
+
+static void Check(bool ok, const std::string &name){
+    if (ok) return;
+    fprintf(stderr, "FAIL %s\n", name.c_str());
+    failures++;
+}
+
+/*
+ *  Frame the bytes as the first ones received on a new connection, the parsed request
+ *  is copied to request for FRAME_DONE and FRAME_PAYLOAD
+ */
+static int Frame_bytes(const std::string &bytes, request_t &request){
+    connection_t connection(-1, -1);
+    memcpy(connection.buffer, bytes.data(), bytes.size());
+    connection.buffer_end = bytes.size();
+    try{
+        if (Frame_request(connection, request)) return FRAME_DONE;
+    }
+    catch (SysError &){
+        return FRAME_REJECTED;
+    }
+    if (!connection.if_partial) return FRAME_WAITING;
+    request = std::move(connection.partial);
+    return FRAME_PAYLOAD;
+}
+
+static std::string Longest_username(){
+    return std::string(FS_MAXUSERNAME, 'u');
+}
+
+/*
+ *  A pathname of FS_MAXPATHNAME characters made of the longest names that fit
+ */
+static std::string Longest_pathname(){
+    std::string pathname;
+    for (char name = 'a'; pathname.length() + 1 < FS_MAXPATHNAME; name++) {
+        size_t length = std::min<size_t>(FS_MAXFILENAME, FS_MAXPATHNAME - pathname.length() - 1);
+        pathname += '/';
+        pathname.append(length, name);
+    }
+    return pathname;
+}
+
+static void Check_fields(const request_t &request, int type, const std::string &username,
+                         const std::string &pathname, uint32_t block, uint32_t count, const std::string &name){
+    Check(request.request_type == type, name + ": type");
+    Check(std::string(request.username, request.username_length) == username, name + ": username");
+    Check(std::string(request.pathname, request.pathname_length) == pathname, name + ": pathname");
+    Check(request.block == block && request.count == count, name + ": block and count");
+}
+
+static void Check_limits(){
+    const std::string username = Longest_username();
+    const std::string pathname = Longest_pathname();
+    const std::string names = username + " " + pathname;
+    Check(pathname.length() == FS_MAXPATHNAME, "limits: longest pathname");
+    disk_size = 1u << 31;
+
+    std::string longest = "FS_WRITEBLOCKS " + names + " 4294967295 4294967295";
+    Check(longest.length() == (size_t)max_message_length, "limits: max_message_length is the longest request grammar");
+
+    request_t request;
+    std::string header = "FS_READBLOCKS " + names + " 2147479552 4096";
+    Check(Frame_bytes(header + '\0', request) == FRAME_DONE, "limits: longest READBLOCKS");
+    Check_fields(request, READBLOCKS, username, pathname, 2147479552, 4096, "limits: longest READBLOCKS");
+    header = "FS_WRITEBLOCKS " + names + " 2147479552 4096";
+    Check(Frame_bytes(header + '\0', request) == FRAME_PAYLOAD, "limits: longest WRITEBLOCKS");
+    Check_fields(request, WRITEBLOCKS, username, pathname, 2147479552, 4096, "limits: longest WRITEBLOCKS");
+    header = "FS_READBLOCK " + names + " 2147483647";
+    Check(Frame_bytes(header + '\0', request) == FRAME_DONE, "limits: longest READBLOCK");
+    Check_fields(request, READ, username, pathname, 2147483647, 1, "limits: longest READBLOCK");
+    header = "FS_WRITEBLOCK " + names + " 2147483647";
+    Check(Frame_bytes(header + '\0', request) == FRAME_PAYLOAD, "limits: longest WRITEBLOCK");
+    Check_fields(request, WRITE, username, pathname, 2147483647, 1, "limits: longest WRITEBLOCK");
+    Check(Frame_bytes("FS_CREATE " + names + " f" + '\0', request) == FRAME_DONE, "limits: longest CREATE");
+    Check(Frame_bytes("FS_DELETE " + names + '\0', request) == FRAME_DONE, "limits: longest DELETE");
+
+    /*** The NUL may be the byte right after max_message_length bytes of header, but no later ***/
+    std::string unterminated(max_message_length, 'F');
+    Check(Frame_bytes(unterminated, request) == FRAME_WAITING, "limits: header of max_message_length bytes may go on");
+    Check(Frame_bytes(unterminated + 'F', request) == FRAME_REJECTED, "limits: longer header is rejected");
+
+    /*** Response headers are written into a buffer of max_message_length + 1 bytes ***/
+    request.request_type = WRITEBLOCKS;
+    memcpy(request.username, username.c_str(), username.length() + 1);
+    request.username_length = username.length();
+    memcpy(request.pathname, pathname.c_str(), pathname.length() + 1);
+    request.pathname_length = pathname.length();
+    request.block = request.count = UINT32_MAX;
+    char response[max_message_length + 1];
+    size_t response_length = Format_response_header(request, response);
+    Check(response_length == (size_t)max_message_length + 1, "limits: longest response header");
+    Check(std::string(response, response_length) == longest + '\0', "limits: response header echoes the request");
+}
+
+/*
+ *  The parser Message_Parsing replaced: the message must match the regex of its type, is split
+ *  with an istringstream, and must be equal to the message rebuilt from the parsed fields
+ *  (Check_Valid_Message), then the fields are checked (Check_Valid_Request). Both checks are
+ *  copied here, so that a change to the validation of the server shows up as a mismatch.
+ *  Block numbers were read with atoi, which wraps like the cast below on 64-bit Linux, and values
+ *  that do not fit in 32 bits fail the rebuilt comparison.
+ */
+static const std::regex READ_REG("^(FS_READBLOCK [^ \n\t\v\f\r]+ [^ \n\t\v\f\r]+ [0-9]+)$");
+static const std::regex WRITE_REG("^(FS_WRITEBLOCK [^ \n\t\v\f\r]+ [^ \n\t\v\f\r]+ [0-9]+)$");
+static const std::regex CREATE_REG("^(FS_CREATE [^ \n\t\v\f\r]+ [^ \n\t\v\f\r]+ [fd]+)$");
+static const std::regex DELETE_REG("^(FS_DELETE [^ \n\t\v\f\r]+ [^ \n\t\v\f\r]+)$");
+
+struct reference_request_t {
+    int request_type;
+    std::string username;
+    std::string pathname;
+    uint32_t block = 0;
+    char type = 0;
+};
+
+static int Reference_request_type(const std::string &message){
+    if (std::regex_match(message, READ_REG))   return READ;
+    if (std::regex_match(message, WRITE_REG))  return WRITE;
+    if (std::regex_match(message, CREATE_REG)) return CREATE;
+    if (std::regex_match(message, DELETE_REG)) return DELETE;
+    throw SysError("Unkown Message Type");
+}
+
+static uint32_t Reference_string_to_int(const std::string &block){
+    if (block.length() == 0) throw SysError("Empty block number");
+    if (block[0] == '0' && block.length() > 1) throw SysError("Leading Zeros in Block");
+    for (char c : block) {
+        if ((c < '0') || (c > '9')) throw SysError("Invalid block number");
+    }
+    return (uint32_t)strtoull(block.c_str(), NULL, 10);
+}
+
+static void Reference_check_valid_message(const std::string &message, const reference_request_t &request){
+    std::string rebuilt;
+    if (request.request_type == READ) {
+        rebuilt = "FS_READBLOCK " + request.username + " " + request.pathname + " " + std::to_string(request.block);
+    }
+    else if (request.request_type == WRITE) {
+        rebuilt = "FS_WRITEBLOCK " + request.username + " " + request.pathname + " " + std::to_string(request.block);
+    }
+    else if (request.request_type == CREATE) {
+        rebuilt = "FS_CREATE " + request.username + " " + request.pathname + " " + request.type;
+    }
+    else if (request.request_type == DELETE) {
+        rebuilt = "FS_DELETE " + request.username + " " + request.pathname;
+    }
+    if (rebuilt != message) throw SysError("Invalid Input Request Message!");
+}
+
+/*
+ *  The original limit was FS_MAXFILEBLOCKS. Files have grown past it since, a block is now only
+ *  bounded by the disk here and by the size of the file once its inode is read.
+ */
+static uint32_t Reference_block_limit(){
+    return disk_size;
+}
+
+static void Reference_check_valid_request(const reference_request_t &request){
+    if (request.block >= Reference_block_limit()) throw SysError("Block Overflow");
+    if ((request.username.length() > FS_MAXUSERNAME) || (request.username.length() == 0)) throw SysError("Username Length Overflow");
+    if ((request.pathname.length() > FS_MAXPATHNAME) || (request.pathname.length() == 0)) throw SysError("Pathname Length Overflow");
+    if ((request.pathname[0] != '/') || (request.pathname[request.pathname.length() - 1] == '/')) throw SysError("Pathname Not Valid");
+}
+
+static reference_request_t Reference_parsing(const std::string &message){
+    reference_request_t request;
+    request.request_type = Reference_request_type(message);
+    std::istringstream m_stream{message};
+    std::string protocal_type, block_string, type_string;
+    if ((request.request_type == READ) || (request.request_type == WRITE)) {
+        m_stream >> protocal_type >> request.username >> request.pathname >> block_string;
+        request.block = Reference_string_to_int(block_string);
+    }
+    else if (request.request_type == CREATE) {
+        m_stream >> protocal_type >> request.username >> request.pathname >> type_string;
+        if (type_string == "d")      request.type = 'd';
+        else if (type_string == "f") request.type = 'f';
+        else throw SysError("Invalid type");
+    }
+    else {
+        m_stream >> protocal_type >> request.username >> request.pathname;
+    }
+    Reference_check_valid_message(message, request);
+    Reference_check_valid_request(request);
+    return request;
+}
+
+/*
+ *  The request types added since the old parser, every message with whether Message_Parsing must
+ *  accept it and the fields it must fill in then
+ */
+struct expected_request_t {
+    const char *message;
+    bool accepted;
+    int request_type;
+    uint32_t block;
+    uint32_t count;
+};
+
+static const expected_request_t expected_requests[] = {
+    {"FS_SESSION",                       true,  SESSION,     0, 1},
+    {"FS_SESSION ",                      false, 0, 0, 0},
+    {"FS_SESSION u",                     false, 0, 0, 0},
+    {" FS_SESSION",                      false, 0, 0, 0},
+    {"FS_SESSIONS",                      false, 0, 0, 0},
+    {"FS_READBLOCKS u /a 0 1",           true,  READBLOCKS,  0, 1},
+    {"FS_READBLOCKS u /a 7 4096",        true,  READBLOCKS,  7, 4096},
+    {"FS_READBLOCKS u /a 0 4097",        false, 0, 0, 0},
+    {"FS_READBLOCKS u /a 0 0",           false, 0, 0, 0},
+    {"FS_READBLOCKS u /a 0 01",          false, 0, 0, 0},
+    {"FS_READBLOCKS u /a 01 1",          false, 0, 0, 0},
+    {"FS_READBLOCKS u /a 0",             false, 0, 0, 0},
+    {"FS_READBLOCKS u /a 0 1 1",         false, 0, 0, 0},
+    {"FS_READBLOCKS u /a 0  1",          false, 0, 0, 0},
+    {"FS_READBLOCKS u /a 0 1 ",          false, 0, 0, 0},
+    {"FS_READBLOCKS u /a 0 +1",          false, 0, 0, 0},
+    {"FS_READBLOCKS u /a/ 0 1",          false, 0, 0, 0},
+    {"FS_READBLOCKS u /a 2147483647 1",  true,  READBLOCKS,  2147483647, 1},
+    {"FS_READBLOCKS u /a 2147483647 2",  false, 0, 0, 0},
+    {"FS_READBLOCKS u /a 2147483648 1",  false, 0, 0, 0},
+    {"FS_READBLOCKS u /a 0 4294967296",  false, 0, 0, 0},
+    {"FS_WRITEBLOCKS u /a 3 2",          true,  WRITEBLOCKS, 3, 2},
+    {"FS_WRITEBLOCKS u /a 0 4096",       true,  WRITEBLOCKS, 0, 4096},
+    {"FS_WRITEBLOCKS u /a 0 4097",       false, 0, 0, 0},
+    {"FS_WRITEBLOCKS u /a 0 0",          false, 0, 0, 0},
+    {"FS_WRITEBLOCKS u /a 0",            false, 0, 0, 0},
+    {"FS_WRITEBLOCKS uuuuuuuuuuu /a 0 1", false, 0, 0, 0},
+    {"FS_WRITEBLOCKS u a 0 1",           false, 0, 0, 0},
+    {"FS_WRITEBLOCKS u\t/a 0 1",         false, 0, 0, 0},
+    {"FS_CREATE u /a e",                 false, 0, 0, 0},
+};
+
+static void Check_requests(){
+    for (const expected_request_t &expected : expected_requests) {
+        std::string name = std::string("requests: \"") + expected.message + "\"";
+        request_t request;
+        bool accepted = true;
+        try{
+            request = Message_Parsing(expected.message);
+        }
+        catch (SysError &){
+            accepted = false;
+        }
+        Check(accepted == expected.accepted, name + (expected.accepted ? " is accepted" : " is rejected"));
+        if (!accepted || !expected.accepted) continue;
+        Check(request.request_type == expected.request_type, name + ": type");
+        Check(request.block == expected.block && request.count == expected.count, name + ": block and count");
+        if (request.request_type != SESSION) {
+            Check(std::string(request.username, request.username_length) == "u", name + ": username");
+            Check(std::string(request.pathname, request.pathname_length) == "/a", name + ": pathname");
+        }
+    }
+    printf("requests      %zu messages of the new request types\n", sizeof(expected_requests) / sizeof(expected_requests[0]));
+}
+
+/*
+ *  Corpus of messages of the original grammar built from fields that sit on both sides of every
+ *  one of its rules, joined mostly by single spaces and sometimes by none, two, or other whitespace.
+ *  The only other keywords are misspelled ones, which both parsers must reject.
+ */
+static void Generate_corpus(size_t message_count, unsigned int seed, std::vector<std::string> &corpus){
+    static const char *keywords[] = {"FS_READBLOCK", "FS_WRITEBLOCK", "FS_CREATE", "FS_DELETE",
+                                     "fs_create", "FS_READBLOCKX", "FS_DELETEX", "FS_"};
+    static const size_t field_counts[] = {4, 4, 4, 3, 4, 4, 3, 2};
+    const std::string username = Longest_username();
+    const std::string pathname = Longest_pathname();
+    const std::vector<std::string> usernames = {"u", "user", username, username + "x", "a\tb", "\x01"};
+    const std::vector<std::string> pathnames = {"/", "/a", "/a/b", "a", "/a/", "//a", pathname, pathname + "x",
+                                                "/" + std::string(FS_MAXFILENAME + 1, 'n')};
+    const std::vector<std::string> numbers = {"0", "1", "00", "01", "123", "4096", "4097", "2147483647", "2147483648",
+                                              "4294967295", "4294967296", "99999999999999999999", "-1", "1a", "+1"};
+    const std::vector<std::string> types = {"f", "d", "e", "x", "ff", "fd", "F"};
+    const std::vector<std::string> separators = {" ", " ", " ", " ", " ", " ", " ", " ", "", "  ", "\t", "\n"};
+    std::mt19937 random(seed);
+    auto pick = [&](const std::vector<std::string> &pool) -> const std::string & { return pool[random() % pool.size()]; };
+    corpus.clear();
+    for (size_t i = 0; i < message_count; i++) {
+        size_t keyword = random() % (sizeof(keywords) / sizeof(keywords[0]));
+        /*** Mostly the right number of fields for the keyword, otherwise one missing or extra ***/
+        size_t field_count = field_counts[keyword];
+        int shape = random() % 8;
+        if (shape == 0 && field_count > 1) field_count--;
+        else if (shape == 1) field_count++;
+        std::string message = (random() % 16 == 0) ? pick(separators) : "";
+        message += keywords[keyword];
+        for (size_t field = 1; field < field_count; field++) {
+            message += (random() % 4 == 0) ? pick(separators) : " ";
+            if (field == 1) message += pick(usernames);
+            else if (field == 2) message += pick(pathnames);
+            else if (field == 3 && keyword == 2) message += pick(types);
+            else message += pick(numbers);
+        }
+        if (random() % 16 == 0) message += pick(separators);
+        corpus.push_back(message);
+    }
+}
+
+static void Check_differential(const std::vector<std::string> &corpus, std::vector<std::string> &accepted_corpus,
+                               std::vector<std::string> &rejected_corpus){
+    size_t accepted = 0, mismatches = 0;
+    size_t accepted_types[DELETE + 1] = {};
+    for (const std::string &message : corpus) {
+        reference_request_t expected;
+        request_t request;
+        bool expected_ok = true, ok = true;
+        try{
+            expected = Reference_parsing(message);
+        }
+        catch (SysError &){
+            expected_ok = false;
+        }
+        try{
+            request = Message_Parsing(message);
+        }
+        catch (SysError &){
+            ok = false;
+        }
+        bool same = (ok == expected_ok);
+        if (same && ok) {
+            same = request.request_type == expected.request_type && request.block == expected.block && request.count == 1 &&
+                   std::string(request.username, request.username_length) == expected.username &&
+                   std::string(request.pathname, request.pathname_length) == expected.pathname;
+            if (request.request_type == CREATE) same = same && request.type == expected.type;
+        }
+        accepted += ok;
+        if (ok && request.request_type <= DELETE) accepted_types[request.request_type]++;
+        (ok ? accepted_corpus : rejected_corpus).push_back(message);
+        if (!same && mismatches++ < 10) Check(false, "differential: \"" + message + "\" " + (ok ? "accepted" : "rejected") +
+                                             " by Message_Parsing, " + (expected_ok ? "accepted" : "rejected") + " by the old parser");
+    }
+    Check(mismatches == 0, "differential: " + std::to_string(mismatches) + " mismatches");
+    for (int type = READ; type <= DELETE; type++) {
+        Check(accepted_types[type] > 0, "differential: no accepted message of request type " + std::to_string(type));
+    }
+    printf("differential  %zu messages, %zu accepted, %zu mismatches\n", corpus.size(), accepted, mismatches);
+}
+
+/*
+ *  Time one parser over the whole corpus, in nanoseconds per message
+ */
+template <typename parser_t>
+static double Time_parser(const std::vector<std::string> &corpus, parser_t parser){
+    auto start = std::chrono::steady_clock::now();
+    size_t accepted = 0;
+    for (const std::string &message : corpus) {
+        try{
+            accepted += parser(message);
+        }
+        catch (SysError &){
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    if (accepted == SIZE_MAX) printf("\n");     // keeps the result alive
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / corpus.size();
+}
+
+static void Time_parsers(const std::vector<std::string> &corpus, const char *name){
+    if (corpus.empty()) return;
+    double reference_ns = Time_parser(corpus, [](const std::string &message){ return Reference_parsing(message).pathname.length(); });
+    double parser_ns = Time_parser(corpus, [](const std::string &message){ return Message_Parsing(message).pathname_length; });
+    printf("timing        %s: old parser %.0f ns/message, Message_Parsing %.0f ns/message, %.1fx\n",
+           name, reference_ns, parser_ns, reference_ns / parser_ns);
+}
+
+int main(int argc, char *argv[]){
+    size_t message_count = 200000;
+    unsigned int seed = 1;
+    int option;
+    while ((option = getopt(argc, argv, "n:s:")) != -1) {
+        if (option == 'n') message_count = strtoul(optarg, NULL, 10);
+        else if (option == 's') seed = strtoul(optarg, NULL, 10);
+        else {
+            fprintf(stderr, "Usage: fs_parse [-n messages] [-s seed]\n");
+            return 1;
+        }
+    }
+    Check_limits();
+    Check_requests();
+    std::vector<std::string> corpus;
+    Generate_corpus(message_count, seed, corpus);
+    std::vector<std::string> accepted_corpus, rejected_corpus;
+    Check_differential(corpus, accepted_corpus, rejected_corpus);
+    Time_parsers(accepted_corpus, "accepted");
+    Time_parsers(rejected_corpus, "rejected");
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * fs_report.cpp
+ *
+ * Offline fragmentation and locality report of a disk image.
+ * It walks the directory tree of an image written by the server (the file given with -D,
+ * or FS_DISK_FILE of the stand-in disk) and reports how the blocks are laid out:
+ *     tree        directories, files (extent and inline ones among them) and data blocks
+ *     files       runs of contiguous blocks per file, and the mean gap
+ *                 between consecutive blocks of a file (0 if every file is contiguous)
+ *     placement   how often an inode sits in the allocation group of its directory, the
+ *                 direntry blocks in the group of their directory, and the first data block
+ *                 of a file in the group of its inode, with the mean distances in blocks
+ *     spread      allocation groups holding at least one directory inode
+ *     free space  free blocks, number of free runs and the largest one
+ * Read the image only while the server is stopped, after a clean shutdown in write-back mode.
+ *
+ * Run after make:
+ *     FS_DISK_FILE=disk.img build/fs_server 8000 &  ...  kill %1
+ *     build/fs_report disk.img
+ *
+ * Usage: fs_report image
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../inode_map.h"
+#include "../alloc.h"
+
+struct report_t {
+    uint64_t directories = 0;
+    uint64_t files = 0;
+    uint64_t extent_files = 0;
+    uint64_t inline_files = 0;              // files whose data is in the inode
+    uint64_t data_blocks = 0;
+    uint64_t runs = 0;                      // runs of contiguous data blocks, summed over files
+    uint64_t contiguous_files = 0;          // files with at most one run
+    uint64_t gaps = 0;                      // consecutive file blocks that are not adjacent on disk
+    uint64_t gap_distance = 0;              // blocks skipped over between them
+    uint64_t inodes = 0;                    // inodes below the root
+    uint64_t inodes_in_group = 0;           // ... in the allocation group of their directory
+    uint64_t inode_distance = 0;
+    uint64_t direntry_blocks = 0;
+    uint64_t direntry_in_group = 0;
+    uint64_t first_blocks = 0;              // files with at least one data block
+    uint64_t first_in_group = 0;            // ... whose first block is in the group of the inode
+    uint64_t first_distance = 0;
+};
+
+static int image_fd = -1;
+static uint32_t image_blocks = 0;
+static std::vector<bool> used_blocks;
+
+static void Read_block(uint32_t block, void *buf){
+    if (block >= image_blocks || pread(image_fd, buf, FS_BLOCKSIZE, (off_t)block * FS_BLOCKSIZE) != FS_BLOCKSIZE) {
+        fprintf(stderr, "fs_report: cannot read block %u\n", block);
+        exit(1);
+    }
+}
+
+static uint64_t Distance(uint32_t from, uint32_t to){
+    return (from > to) ? from - to : to - from;
+}
+
+static bool Same_group(uint32_t a, uint32_t b){
+    return a / FS_ALLOC_GROUP_BLOCKS == b / FS_ALLOC_GROUP_BLOCKS;
+}
+
+static void Mark_used(uint32_t block){
+    if (block < image_blocks) used_blocks[block] = true;
+}
+
+/*
+ *  Disk blocks of a file in file order, for both plain and extent files
+ */
+static void File_blocks(const fs_inode &inode, std::vector<uint32_t> &blocks){
+    blocks.clear();
+    if (inode.type == 'i') return;
+    if (inode.type != 'e') {
+        blocks.assign(inode.blocks, inode.blocks + std::min(inode.size, FS_MAXFILEBLOCKS));
+        return;
+    }
+    fs_extent_inode extent_inode;
+    memcpy(&extent_inode, &inode, sizeof(extent_inode));
+    std::vector<fs_extent> extents(extent_inode.extents, extent_inode.extents + std::min(extent_inode.extent_count, FS_INLINE_EXTENTS));
+    if (extent_inode.extent_count > FS_INLINE_EXTENTS && extent_inode.extent_count <= FS_MAXEXTENTS) {
+        fs_extent indirect[FS_INDIRECT_EXTENTS];
+        Read_block(extent_inode.indirect_block, indirect);
+        Mark_used(extent_inode.indirect_block);
+        extents.insert(extents.end(), indirect, indirect + extent_inode.extent_count - FS_INLINE_EXTENTS);
+    }
+    for (const fs_extent &extent : extents) {
+        for (uint32_t i = 0; i < extent.length && blocks.size() < extent_inode.size; i++) blocks.push_back(extent.start + i);
+    }
+}
+
+static void Report_file(uint32_t inode_id, const fs_inode &inode, report_t &report){
+    static std::vector<uint32_t> blocks;
+    File_blocks(inode, blocks);
+    report.files++;
+    if (inode.type == 'e') report.extent_files++;
+    if (inode.type == 'i') report.inline_files++;
+    report.data_blocks += blocks.size();
+    uint64_t runs = blocks.empty() ? 0 : 1;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        Mark_used(blocks[i]);
+        if (i > 0 && blocks[i] != blocks[i - 1] + 1) {
+            runs++;
+            report.gaps++;
+            report.gap_distance += Distance(blocks[i - 1] + 1, blocks[i]);
+        }
+    }
+    report.runs += runs;
+    if (runs <= 1) report.contiguous_files++;
+    if (!blocks.empty()) {
+        report.first_blocks++;
+        if (Same_group(inode_id, blocks[0])) report.first_in_group++;
+        report.first_distance += Distance(inode_id, blocks[0]);
+    }
+}
+
+/*
+ *  Walk the tree breadth first from the root inode in block 0
+ */
+static void Walk(report_t &report, std::vector<bool> &directory_groups){
+    std::queue<uint32_t> directories;
+    directories.push(0);
+    Mark_used(0);
+    while (!directories.empty()) {
+        uint32_t dir_id = directories.front();
+        directories.pop();
+        fs_inode dir_inode;
+        Read_block(dir_id, &dir_inode);
+        report.directories++;
+        directory_groups[dir_id / FS_ALLOC_GROUP_BLOCKS] = true;
+        for (uint32_t i = 0; i < std::min(dir_inode.size, FS_MAXFILEBLOCKS); i++) {
+            uint32_t direntry_block = dir_inode.blocks[i];
+            Mark_used(direntry_block);
+            report.direntry_blocks++;
+            if (Same_group(dir_id, direntry_block)) report.direntry_in_group++;
+            fs_direntry direntries[FS_DIRENTRIES];
+            Read_block(direntry_block, direntries);
+            for (unsigned int j = 0; j < FS_DIRENTRIES; j++) {
+                uint32_t inode_id = direntries[j].inode_block;
+                if (inode_id == 0) continue;
+                Mark_used(inode_id);
+                report.inodes++;
+                if (Same_group(dir_id, inode_id)) report.inodes_in_group++;
+                report.inode_distance += Distance(dir_id, inode_id);
+                fs_inode inode;
+                Read_block(inode_id, &inode);
+                if (inode.type == 'd') directories.push(inode_id);
+                else Report_file(inode_id, inode, report);
+            }
+        }
+    }
+}
+
+/*
+ *  The on-disk bitmap region, if the server keeps one, is used space as well
+ */
+static void Mark_bitmap_region(){
+    uint32_t bitmap_words = (image_blocks + 63) / 64;
+    uint32_t bitmap_blocks = (bitmap_words * sizeof(uint64_t) + FS_BLOCKSIZE - 1) / FS_BLOCKSIZE;
+    if (image_blocks < bitmap_blocks + 2) return;
+    uint32_t header_block = image_blocks - bitmap_blocks - 1;
+    fs_bitmap_header header[FS_BLOCKSIZE / sizeof(fs_bitmap_header)];
+    Read_block(header_block, header);
+    if (header[0].magic != FS_BITMAP_MAGIC || header[0].disk_size != image_blocks) return;
+    for (uint32_t i = header_block; i < image_blocks; i++) Mark_used(i);
+}
+
+static double Percent(uint64_t part, uint64_t whole){
+    return (whole == 0) ? 0.0 : 100.0 * part / whole;
+}
+
+static double Mean(uint64_t sum, uint64_t count){
+    return (count == 0) ? 0.0 : (double)sum / count;
+}
+
+int main(int argc, char *argv[]){
+    if (argc != 2) {
+        fprintf(stderr, "Usage: fs_report image\n");
+        return 1;
+    }
+    image_fd = open(argv[1], O_RDONLY);
+    struct stat image_stat;
+    if (image_fd == -1 || fstat(image_fd, &image_stat) == -1) {
+        perror("fs_report");
+        return 1;
+    }
+    image_blocks = image_stat.st_size / FS_BLOCKSIZE;
+    used_blocks.assign(image_blocks, false);
+    uint32_t group_count = (image_blocks + FS_ALLOC_GROUP_BLOCKS - 1) / FS_ALLOC_GROUP_BLOCKS;
+    std::vector<bool> directory_groups(group_count, false);
+    report_t report;
+    Walk(report, directory_groups);
+    Mark_bitmap_region();
+
+    uint64_t free_blocks = 0, free_runs = 0, largest_free_run = 0, curr_run = 0;
+    for (uint32_t i = 0; i < image_blocks; i++) {
+        if (used_blocks[i]) {
+            curr_run = 0;
+            continue;
+        }
+        free_blocks++;
+        if (curr_run++ == 0) free_runs++;
+        largest_free_run = std::max(largest_free_run, curr_run);
+    }
+    uint64_t spread = std::count(directory_groups.begin(), directory_groups.end(), true);
+
+    printf("disk        %u blocks, %u allocation groups of %u blocks\n", image_blocks, group_count, FS_ALLOC_GROUP_BLOCKS);
+    printf("tree        %llu directories, %llu files (%llu extent, %llu inline), %llu data blocks\n",
+           (unsigned long long)report.directories, (unsigned long long)report.files,
+           (unsigned long long)report.extent_files, (unsigned long long)report.inline_files,
+           (unsigned long long)report.data_blocks);
+    printf("files       %.2f runs per file, %.1f%% contiguous, mean gap %.1f blocks\n",
+           Mean(report.runs, report.files), Percent(report.contiguous_files, report.files),
+           Mean(report.gap_distance, report.gaps));
+    printf("placement   inode in directory group %.1f%% (mean distance %.1f), direntry block in directory group %.1f%%, "
+           "first data block in inode group %.1f%% (mean distance %.1f)\n",
+           Percent(report.inodes_in_group, report.inodes), Mean(report.inode_distance, report.inodes),
+           Percent(report.direntry_in_group, report.direntry_blocks),
+           Percent(report.first_in_group, report.first_blocks), Mean(report.first_distance, report.first_blocks));
+    printf("spread      directories in %llu of %u groups\n", (unsigned long long)spread, group_count);
+    printf("free space  %llu blocks in %llu runs, largest run %llu blocks\n",
+           (unsigned long long)free_blocks, (unsigned long long)free_runs, (unsigned long long)largest_free_run);
+    close(image_fd);
+    return 0;
+}
@@ -0,0 +1,230 @@
+#include "block_io.h"
+#include "helper.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+extern const char *disk_device;
+
+static const unsigned int BLOCK_IO_RING_DEPTH = 64;    // max I/Os in flight per thread
+
+/*
+ *  Where the blocks live: the external disk_readblock/disk_writeblock by default,
+ *  or the file or block device given with -D, read with io_uring when the kernel allows it
+ */
+static int device_fd = -1;
+static bool uring_enabled = false;
+
+/*
+ *  io_uring of one thread, set up with the raw system calls on its first batch.
+ *  Each thread submits and reaps only its own I/Os, so no lock is needed.
+ */
+struct block_ring_t {
+    int fd = -1;
+    bool failed = false;                    // setup failed, this thread uses pread/pwrite
+    void *sq_map = MAP_FAILED;
+    size_t sq_map_size = 0;
+    void *cq_map = MAP_FAILED;
+    size_t cq_map_size = 0;
+    struct io_uring_sqe *sqes = (struct io_uring_sqe *)MAP_FAILED;
+    size_t sqes_size = 0;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    ~block_ring_t();
+};
+
+block_ring_t::~block_ring_t(){
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (cq_map != MAP_FAILED && cq_map != sq_map) munmap(cq_map, cq_map_size);
+    if (sq_map != MAP_FAILED) munmap(sq_map, sq_map_size);
+    if (fd != -1) close(fd);
+}
+
+static thread_local block_ring_t local_ring;
+
+static bool Ring_setup(block_ring_t &ring){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, BLOCK_IO_RING_DEPTH, &params);
+    if (ring.fd == -1) return false;
+    ring.sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring.cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.sq_map_size = ring.cq_map_size = std::max(ring.sq_map_size, ring.cq_map_size);
+    }
+    ring.sq_map = mmap(NULL, ring.sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_map == MAP_FAILED) return false;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) ring.cq_map = ring.sq_map;
+    else ring.cq_map = mmap(NULL, ring.cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    if (ring.cq_map == MAP_FAILED) return false;
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = (struct io_uring_sqe *)mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) return false;
+    char *sq = (char *)ring.sq_map;
+    char *cq = (char *)ring.cq_map;
+    ring.sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring.cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+/*
+ *  Return the ring of the calling thread, or nullptr if io_uring cannot be used
+ */
+static block_ring_t *Local_ring(){
+    if (!uring_enabled || local_ring.failed) return nullptr;
+    if (local_ring.fd == -1 && !Ring_setup(local_ring)) {
+        local_ring.failed = true;
+        TestPrint("---------- io_uring setup failed, using pread/pwrite ---------- ", errno);
+        return nullptr;
+    }
+    return &local_ring;
+}
+
+/*
+ *  Like disk_readblock/disk_writeblock, a failed transfer is not recoverable
+ */
+static void Device_fail(const char *reason){
+    cout_lock.lock();
+    std::cout << "@@@ disk device failure: " << reason << " errno " << errno << std::endl;
+    cout_lock.unlock();
+    abort();
+}
+
+/*
+ *  Synchronous transfer of one block of the device, used when io_uring is unavailable
+ *  and to finish a short transfer
+ */
+static void Device_transfer(uint32_t block, char *buf, bool if_write){
+    off_t offset = (off_t)block * FS_BLOCKSIZE;
+    size_t done = 0;
+    while (done < FS_BLOCKSIZE) {
+        ssize_t n = if_write ? pwrite(device_fd, buf + done, FS_BLOCKSIZE - done, offset + done)
+                             : pread(device_fd, buf + done, FS_BLOCKSIZE - done, offset + done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) Device_fail("pread/pwrite");
+        done += n;
+    }
+}
+
+/*
+ *  Transfer up to BLOCK_IO_RING_DEPTH blocks with one submission and wait for all of them
+ */
+static void Ring_transfer(block_ring_t &ring, uint32_t count, const uint32_t *blocks, char *const *bufs, bool if_write){
+    unsigned int tail = *ring.sq_tail;
+    for (uint32_t i = 0; i < count; i++) {
+        unsigned int index = (tail + i) & *ring.sq_mask;
+        struct io_uring_sqe &sqe = ring.sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = if_write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe.fd = device_fd;
+        sqe.addr = (uint64_t)(uintptr_t)bufs[i];
+        sqe.len = FS_BLOCKSIZE;
+        sqe.off = (uint64_t)blocks[i] * FS_BLOCKSIZE;
+        sqe.user_data = i;
+        ring.sq_array[index] = index;
+    }
+    __atomic_store_n(ring.sq_tail, tail + count, __ATOMIC_RELEASE);
+    uint32_t submitted = 0, completed = 0;
+    while (completed < count) {
+        int n = syscall(__NR_io_uring_enter, ring.fd, count - submitted, count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n == -1 && errno != EINTR) Device_fail("io_uring_enter");
+        if (n > 0) submitted += n;
+        unsigned int head = *ring.cq_head;
+        unsigned int cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++, completed++) {
+            struct io_uring_cqe &cqe = ring.cqes[head & *ring.cq_mask];
+            uint32_t i = cqe.user_data;
+            /*** Errors and short transfers are redone synchronously ***/
+            if (cqe.res != (int)FS_BLOCKSIZE) Device_transfer(blocks[i], bufs[i], if_write);
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ *  Transfer count blocks, keeping as many of them in flight as the ring allows
+ */
+static void Batch_transfer(uint32_t count, const uint32_t *blocks, char *const *bufs, bool if_write){
+    if (count == 0) return;
+    metrics_timer_t disk_timer(if_write ? METRIC_DISK_WRITE : METRIC_DISK_READ);
+    if (device_fd == -1) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (if_write) disk_writeblock(blocks[i], bufs[i]);
+            else disk_readblock(blocks[i], bufs[i]);
+        }
+        return;
+    }
+    block_ring_t *ring = Local_ring();
+    for (uint32_t first = 0; first < count; first += BLOCK_IO_RING_DEPTH) {
+        uint32_t chunk = std::min(count - first, BLOCK_IO_RING_DEPTH);
+        if (ring != nullptr) {
+            Ring_transfer(*ring, chunk, blocks + first, bufs + first, if_write);
+            continue;
+        }
+        for (uint32_t i = first; i < first + chunk; i++) {
+            Device_transfer(blocks[i], bufs[i], if_write);
+        }
+    }
+}
+
+/*
+ *  Open the disk device given with -D, it must already hold a formatted disk.
+ *  The disk takes the whole file or block device, so disk_size is read from its size.
+ *  Without -D every I/O goes to disk_readblock/disk_writeblock, whose disk has FS_DISKSIZE blocks.
+ */
+void Block_io_init(){
+    if (disk_device == nullptr) return;
+    device_fd = open(disk_device, O_RDWR);
+    if (device_fd == -1) throw SysError("Cannot open disk device");
+    struct stat device_stat;
+    if (fstat(device_fd, &device_stat) == -1) throw SysError("Cannot stat disk device");
+    uint64_t device_bytes = device_stat.st_size;
+    if (S_ISBLK(device_stat.st_mode) && ioctl(device_fd, BLKGETSIZE64, &device_bytes) == -1) {
+        throw SysError("Cannot get the size of the disk device");
+    }
+    uint64_t device_blocks = device_bytes / FS_BLOCKSIZE;
+    /*** Block numbers and the arithmetic on them stay well inside 32 bits ***/
+    if (device_blocks < 64) throw SysError("Disk device is too small");
+    if (device_blocks > (1ULL << 31)) throw SysError("Disk device is too large");
+    disk_size = device_blocks;
+    uring_enabled = true;
+    uring_enabled = Local_ring() != nullptr;
+}
+
+/*
+ *  Single block transfers, a one-block batch
+ */
+void Block_read(uint32_t block, void *buf){
+    char *bufs[1] = {(char *)buf};
+    Batch_transfer(1, &block, bufs, false);
+}
+
+void Block_write(uint32_t block, const void *buf){
+    char *bufs[1] = {(char *)buf};
+    Batch_transfer(1, &block, bufs, true);
+}
+
+/*
+ *  Read or write count blocks, bufs[i] holds block blocks[i].
+ *  With io_uring they are submitted together, otherwise transferred one after another.
+ */
+void Block_read_batch(uint32_t count, const uint32_t *blocks, char *const *bufs){
+    Batch_transfer(count, blocks, bufs, false);
+}
+
+void Block_write_batch(uint32_t count, const uint32_t *blocks, const char *const *bufs){
+    Batch_transfer(count, blocks, (char *const *)bufs, true);
+}
@@ -0,0 +1,16 @@
+#ifndef _BLOCK_IO_H_
+#define _BLOCK_IO_H_
+
+#include "global.h"
+
+void Block_io_init();
+
+void Block_read(uint32_t block, void *buf);
+
+void Block_write(uint32_t block, const void *buf);
+
+void Block_read_batch(uint32_t count, const uint32_t *blocks, char *const *bufs);
+
+void Block_write_batch(uint32_t count, const uint32_t *blocks, const char *const *bufs);
+
+#endif /* _BLOCK_IO_H_ */
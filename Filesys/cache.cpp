@@ -0,0 +1,651 @@
+#include "cache.h"
+#include "block_io.h"
+#include "alloc.h"
+
+extern const unsigned int cache_capacity;
+extern const unsigned int cache_shard_count;
+extern const int cache_flush_interval;
+extern bool write_back_cache;
+
+#define CACHE_FREE    0
+#define CACHE_LOADING 1
+#define CACHE_VALID   2
+
+struct cache_entry_t {
+    uint32_t block;
+    int state;
+    unsigned int pin_count;                 // pinned entries are never evicted
+    bool dirty;                             // write-back mode: newer than the disk, never evicted
+    int kind;                               // BLOCK_* kind of the last write, orders the flush
+    bool prefetched;                        // loaded by readahead and not read since
+    int prev;                               // neighbours in the LRU list, -1 if none
+    int next;
+    char data[FS_BLOCKSIZE];
+};
+
+/*
+ *  Block number -> entry index of one shard, an open addressing table with linear probing.
+ *  It has twice as many slots as the shard has entries, so it never fills up and inserting
+ *  or erasing a block never allocates.
+ */
+struct cache_index_t {
+    struct slot_t {
+        uint32_t block;
+        int entry;                          // -1 if the slot is empty
+    };
+    std::vector<slot_t> slots;
+    size_t mask = 0;
+    void init(size_t entry_count){
+        size_t size = 4;
+        while (size < entry_count * 2) size *= 2;
+        slots.assign(size, slot_t{0, -1});
+        mask = size - 1;
+    }
+    size_t home(uint32_t block) const { return (block * 2654435761u) & mask; }
+    int find(uint32_t block) const {
+        for (size_t i = home(block); slots[i].entry != -1; i = (i + 1) & mask) {
+            if (slots[i].block == block) return slots[i].entry;
+        }
+        return -1;
+    }
+    void insert(uint32_t block, int entry){
+        size_t i = home(block);
+        while (slots[i].entry != -1 && slots[i].block != block) i = (i + 1) & mask;
+        slots[i] = slot_t{block, entry};
+    }
+    void erase(uint32_t block){
+        size_t i = home(block);
+        while (slots[i].entry != -1 && slots[i].block != block) i = (i + 1) & mask;
+        if (slots[i].entry == -1) return;
+        /*** Shift back the following slots that would no longer be reachable from their home ***/
+        size_t hole = i;
+        for (size_t j = (i + 1) & mask; slots[j].entry != -1; j = (j + 1) & mask) {
+            size_t j_home = home(slots[j].block);
+            if (((j - j_home) & mask) >= ((j - hole) & mask)) {
+                slots[hole] = slots[j];
+                hole = j;
+            }
+        }
+        slots[hole].entry = -1;
+    }
+};
+
+struct cache_shard_t {
+    std::mutex lock;
+    std::condition_variable loaded;         // signaled when a CACHE_LOADING entry becomes valid or a direct write ends
+    cache_index_t index;
+    std::vector<cache_entry_t> entries;
+    std::vector<int> free_entries;
+    std::vector<uint32_t> direct_writes;    // uncached blocks being written straight to disk, misses on them wait
+    int lru_head = -1;                      // most recently used
+    int lru_tail = -1;                      // least recently used
+};
+
+static std::vector<cache_shard_t> cache_shards(cache_shard_count);
+static std::atomic<uint64_t> cache_hits(0);
+static std::atomic<uint64_t> cache_misses(0);
+static std::atomic<uint64_t> cache_evictions(0);
+static std::atomic<uint64_t> cache_writes(0);
+static std::atomic<uint64_t> cache_flushes(0);
+static std::atomic<uint64_t> cache_flushed_blocks(0);
+static std::atomic<uint64_t> readahead_blocks(0);
+static std::atomic<uint64_t> readahead_hits(0);
+static std::atomic<uint64_t> readahead_wasted(0);
+
+/*
+ *  Write-back state.
+ *  Writers hold cache_commit_lock shared while they update an entry, a flush holds it exclusively
+ *  while it takes its batch, so every batch is a consistent cut of the writes made so far.
+ */
+static std::shared_mutex cache_commit_lock;
+static std::mutex dirty_list_lock;
+static std::vector<uint32_t> dirty_blocks;  // blocks dirtied since the last batch was taken
+static std::mutex flush_lock;               // one flush at a time, also guards the flush_ lists below
+static std::vector<char> flush_buffer;
+static std::vector<uint32_t> flush_batch;   // swapped with dirty_blocks, so both keep their capacity
+static std::vector<int> flush_kinds;
+static std::vector<size_t> flush_order;
+static std::vector<uint32_t> flush_group_blocks;
+static std::vector<const char *> flush_group_bufs;
+static std::vector<uint32_t> flush_freed;   // blocks freed by the requests whose writes are in the batch
+static std::mutex flusher_lock;
+static std::condition_variable flusher_wake;
+static bool flusher_stopping = false;
+static std::thread flusher_thread;
+
+/*
+ *  The block cache is split into shards by block number, each shard has its own
+ *  lock, LRU list and a fixed number of entries
+ */
+static cache_shard_t &Find_shard(uint32_t block){
+    return cache_shards[block % cache_shard_count];
+}
+
+static void Flusher_running();
+
+/*
+ *  Cache_init() allocates the fixed cache entries, it must run before any other Cache_ call
+ */
+void Cache_init(){
+    for (cache_shard_t &shard : cache_shards) {
+        shard.entries.resize(cache_capacity / cache_shard_count);
+        shard.index.init(shard.entries.size());
+        shard.direct_writes.reserve(shard.entries.size());
+        for (int i = (int)shard.entries.size() - 1; i >= 0; i--) {
+            shard.entries[i].state = CACHE_FREE;
+            shard.free_entries.push_back(i);
+        }
+    }
+    if (write_back_cache) flusher_thread = std::thread(Flusher_running);
+}
+
+static void Lru_remove(cache_shard_t &shard, int index){
+    cache_entry_t &entry = shard.entries[index];
+    if (entry.prev != -1) shard.entries[entry.prev].next = entry.next;
+    else shard.lru_head = entry.next;
+    if (entry.next != -1) shard.entries[entry.next].prev = entry.prev;
+    else shard.lru_tail = entry.prev;
+    entry.prev = entry.next = -1;
+}
+
+static void Lru_push_front(cache_shard_t &shard, int index){
+    cache_entry_t &entry = shard.entries[index];
+    entry.prev = -1;
+    entry.next = shard.lru_head;
+    if (shard.lru_head != -1) shard.entries[shard.lru_head].prev = index;
+    shard.lru_head = index;
+    if (shard.lru_tail == -1) shard.lru_tail = index;
+}
+
+/*
+ *  Find an entry to hold a new block, evicting the least recently used unpinned entry if needed
+ *  Returns -1 if every entry of the shard is pinned, the caller then bypasses the cache
+ *  (a write announces itself with Direct_write_begin so that no miss caches the old contents)
+ */
+static int Allocate_entry(cache_shard_t &shard){
+    if (!shard.free_entries.empty()){
+        int index = shard.free_entries.back();
+        shard.free_entries.pop_back();
+        return index;
+    }
+    for (int index = shard.lru_tail; index != -1; index = shard.entries[index].prev) {
+        cache_entry_t &victim = shard.entries[index];
+        if (victim.pin_count == 0 && victim.state == CACHE_VALID && !victim.dirty){
+            Lru_remove(shard, index);
+            shard.index.erase(victim.block);
+            victim.state = CACHE_FREE;
+            cache_evictions++;
+            if (victim.prefetched) readahead_wasted++;
+            return index;
+        }
+    }
+    return -1;
+}
+
+static bool Is_direct_write(cache_shard_t &shard, uint32_t block){
+    return std::find(shard.direct_writes.begin(), shard.direct_writes.end(), block) != shard.direct_writes.end();
+}
+
+/*
+ *  A block that has no cache entry is written straight to disk between these two calls, made with
+ *  the shard lock held. A miss in between would read the old contents and keep them as valid,
+ *  so it waits for Direct_write_end instead.
+ */
+static void Direct_write_begin(cache_shard_t &shard, uint32_t block){
+    shard.direct_writes.push_back(block);
+}
+
+static void Direct_write_end(cache_shard_t &shard, uint32_t block){
+    auto it = std::find(shard.direct_writes.begin(), shard.direct_writes.end(), block);
+    *it = shard.direct_writes.back();
+    shard.direct_writes.pop_back();
+    shard.loaded.notify_all();
+}
+
+/*
+ *  Look up the entry of a block, loading it from disk on a miss.
+ *  The returned entry is pinned, the caller must drop the pin with the shard lock held.
+ *  Returns -1 if the block could not be cached.
+ */
+static int Load_entry(cache_shard_t &shard, uint32_t block, std::unique_lock<std::mutex> &shard_lock){
+    while (true){
+        int found = shard.index.find(block);
+        if (found == -1 && !Is_direct_write(shard, block)) break;
+        if (found == -1 || shard.entries[found].state == CACHE_LOADING){
+            shard.loaded.wait(shard_lock);
+            continue;
+        }
+        cache_entry_t &entry = shard.entries[found];
+        cache_hits++;
+        if (entry.prefetched){
+            entry.prefetched = false;
+            readahead_hits++;
+        }
+        entry.pin_count++;
+        Lru_remove(shard, found);
+        Lru_push_front(shard, found);
+        return found;
+    }
+    cache_misses++;
+    int index = Allocate_entry(shard);
+    if (index == -1) return -1;
+    cache_entry_t &entry = shard.entries[index];
+    entry.block = block;
+    entry.state = CACHE_LOADING;
+    entry.pin_count = 1;
+    entry.dirty = false;
+    entry.prefetched = false;
+    shard.index.insert(block, index);
+    /*** Read the block without holding the shard lock, other threads wait on shard.loaded ***/
+    shard_lock.unlock();
+    Block_read(block, entry.data);
+    shard_lock.lock();
+    entry.state = CACHE_VALID;
+    Lru_push_front(shard, index);
+    shard.loaded.notify_all();
+    return index;
+}
+
+/*
+ *  Copy disk block "block" into buf, reading it from disk only on a cache miss
+ */
+void Cache_readblock(uint32_t block, void *buf){
+    cache_shard_t &shard = Find_shard(block);
+    std::unique_lock<std::mutex> shard_lock(shard.lock);
+    int index = Load_entry(shard, block, shard_lock);
+    if (index == -1){
+        shard_lock.unlock();
+        Block_read(block, buf);
+        return;
+    }
+    cache_entry_t &entry = shard.entries[index];
+    memcpy(buf, entry.data, FS_BLOCKSIZE);
+    entry.pin_count--;
+}
+
+/*
+ *  Scratch lists of one thread for batched reads and writes.
+ *  They only grow, so a batch no larger than the ones before it does not allocate.
+ */
+struct cache_arena_t {
+    std::vector<int> entries;
+    std::vector<uint32_t> blocks;
+    std::vector<char *> bufs;
+};
+
+static thread_local cache_arena_t local_arena;
+
+/*
+ *  Bring count blocks into the cache with one batch of disk reads.
+ *  With buf set, block blocks[i] is copied to buf + i * FS_BLOCKSIZE. Without it the blocks are
+ *  only prefetched: cached or loading blocks are skipped and the loaded ones marked prefetched.
+ *  Blocks that another thread is loading or writing past the cache are read only once every entry of this batch is valid,
+ *  so that no thread waits for a load while its own loads are pending.
+ */
+static void Load_batch(uint32_t count, const uint32_t *blocks, char *buf){
+    const int LOAD_DONE = -2, LOAD_BYPASS = -1, LOAD_DEFERRED = -3;
+    cache_arena_t &arena = local_arena;
+    std::vector<int> &entries = arena.entries;
+    std::vector<uint32_t> &read_blocks = arena.blocks;
+    std::vector<char *> &read_bufs = arena.bufs;
+    entries.assign(count, LOAD_DONE);
+    read_blocks.clear();
+    read_bufs.clear();
+    for (uint32_t i = 0; i < count; i++) {
+        cache_shard_t &shard = Find_shard(blocks[i]);
+        std::unique_lock<std::mutex> shard_lock(shard.lock);
+        int found = shard.index.find(blocks[i]);
+        if (found != -1) {
+            cache_entry_t &entry = shard.entries[found];
+            if (buf == nullptr) continue;
+            if (entry.state == CACHE_LOADING) {
+                entries[i] = LOAD_DEFERRED;
+                continue;
+            }
+            cache_hits++;
+            if (entry.prefetched){
+                entry.prefetched = false;
+                readahead_hits++;
+            }
+            Lru_remove(shard, found);
+            Lru_push_front(shard, found);
+            memcpy(buf + (size_t)i * FS_BLOCKSIZE, entry.data, FS_BLOCKSIZE);
+            continue;
+        }
+        if (Is_direct_write(shard, blocks[i])) {
+            if (buf != nullptr) entries[i] = LOAD_DEFERRED;
+            continue;
+        }
+        int index = Allocate_entry(shard);
+        if (index == -1) {
+            if (buf == nullptr) continue;
+            cache_misses++;
+            entries[i] = LOAD_BYPASS;
+            read_blocks.push_back(blocks[i]);
+            read_bufs.push_back(buf + (size_t)i * FS_BLOCKSIZE);
+            continue;
+        }
+        if (buf != nullptr) cache_misses++;
+        cache_entry_t &entry = shard.entries[index];
+        entry.block = blocks[i];
+        entry.state = CACHE_LOADING;
+        entry.pin_count = 1;
+        entry.dirty = false;
+        entry.prefetched = false;
+        shard.index.insert(blocks[i], index);
+        entries[i] = index;
+        read_blocks.push_back(blocks[i]);
+        read_bufs.push_back(entry.data);
+    }
+    Block_read_batch(read_blocks.size(), read_blocks.data(), read_bufs.data());
+    /*** Publish every entry of this batch before waiting on the entries of another one ***/
+    for (uint32_t i = 0; i < count; i++) {
+        if (entries[i] < 0) continue;
+        cache_shard_t &shard = Find_shard(blocks[i]);
+        std::unique_lock<std::mutex> shard_lock(shard.lock);
+        cache_entry_t &entry = shard.entries[entries[i]];
+        entry.state = CACHE_VALID;
+        Lru_push_front(shard, entries[i]);
+        shard.loaded.notify_all();
+        if (buf != nullptr) memcpy(buf + (size_t)i * FS_BLOCKSIZE, entry.data, FS_BLOCKSIZE);
+        else {
+            entry.prefetched = true;
+            readahead_blocks++;
+        }
+        entry.pin_count--;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (entries[i] == LOAD_DEFERRED) Cache_readblock(blocks[i], buf + (size_t)i * FS_BLOCKSIZE);
+    }
+}
+
+/*
+ *  Copy count disk blocks into buf, block blocks[i] at buf + i * FS_BLOCKSIZE.
+ *  All misses are read from disk as one batch.
+ */
+void Cache_readblocks(uint32_t count, const uint32_t *blocks, void *buf){
+    Load_batch(count, blocks, (char *)buf);
+}
+
+/*
+ *  Load blocks into the cache ahead of their first read, blocks that are already cached
+ *  are skipped, and so are blocks for which the shard has no entry to spare
+ */
+void Cache_prefetch(uint32_t count, const uint32_t *blocks){
+    Load_batch(count, blocks, nullptr);
+}
+
+/*
+ *  Find the entry of a block that is about to be overwritten, allocating one if it is not cached
+ *  Returns -1 if every entry of the shard is pinned or dirty
+ */
+static int Write_entry(cache_shard_t &shard, uint32_t block, std::unique_lock<std::mutex> &shard_lock){
+    while (true){
+        int found = shard.index.find(block);
+        if (found == -1) break;
+        if (shard.entries[found].state == CACHE_LOADING){
+            shard.loaded.wait(shard_lock);
+            continue;
+        }
+        Lru_remove(shard, found);
+        return found;
+    }
+    int index = Allocate_entry(shard);
+    if (index == -1) return -1;
+    shard.entries[index].block = block;
+    shard.entries[index].state = CACHE_VALID;
+    shard.entries[index].pin_count = 0;
+    shard.entries[index].dirty = false;
+    shard.entries[index].prefetched = false;
+    shard.index.insert(block, index);
+    return index;
+}
+
+/*
+ *  Write-back mode: update the cached copy only and queue the block for the flusher.
+ *  If the shard has no entry to spare, the dirty blocks are flushed first to make room.
+ */
+static void Write_back_block(uint32_t block, const void *buf, int kind){
+    cache_shard_t &shard = Find_shard(block);
+    while (true){
+        {
+            std::shared_lock<std::shared_mutex> commit_lock(cache_commit_lock);
+            std::unique_lock<std::mutex> shard_lock(shard.lock);
+            int index = Write_entry(shard, block, shard_lock);
+            if (index != -1){
+                cache_entry_t &entry = shard.entries[index];
+                memcpy(entry.data, buf, FS_BLOCKSIZE);
+                entry.kind = kind;
+                Lru_push_front(shard, index);
+                if (entry.dirty) return;
+                entry.dirty = true;
+                std::unique_lock<std::mutex> list_lock(dirty_list_lock);
+                dirty_blocks.push_back(block);
+                if (dirty_blocks.size() >= cache_capacity / 2) flusher_wake.notify_one();
+                return;
+            }
+        }
+        Cache_flush();
+    }
+}
+
+/*
+ *  Copy buf to disk block "block", kind is one of BLOCK_* and decides the flush order in write-back mode.
+ *  By default the cache is write-through: the entry stays pinned until the disk write completes,
+ *  so nobody can evict it and read the old contents back from disk in between.
+ */
+void Cache_writeblock(uint32_t block, const void *buf, int kind){
+    cache_writes++;
+    if (write_back_cache){
+        Write_back_block(block, buf, kind);
+        return;
+    }
+    cache_shard_t &shard = Find_shard(block);
+    std::unique_lock<std::mutex> shard_lock(shard.lock);
+    int index = Write_entry(shard, block, shard_lock);
+    if (index == -1){
+        Direct_write_begin(shard, block);
+        shard_lock.unlock();
+        Block_write(block, buf);
+        shard_lock.lock();
+        Direct_write_end(shard, block);
+        return;
+    }
+    cache_entry_t &entry = shard.entries[index];
+    memcpy(entry.data, buf, FS_BLOCKSIZE);
+    entry.pin_count++;
+    Lru_push_front(shard, index);
+    shard_lock.unlock();
+    Block_write(block, buf);
+    shard_lock.lock();
+    entry.pin_count--;
+}
+
+/*
+ *  Copy count blocks of buf to disk, buf + i * FS_BLOCKSIZE goes to block blocks[i].
+ *  In write-through mode the disk writes are issued as one batch.
+ */
+void Cache_writeblocks(uint32_t count, const uint32_t *blocks, const void *buf, int kind){
+    const char *data = (const char *)buf;
+    if (write_back_cache){
+        for (uint32_t i = 0; i < count; i++) {
+            cache_writes++;
+            Write_back_block(blocks[i], data + (size_t)i * FS_BLOCKSIZE, kind);
+        }
+        return;
+    }
+    std::vector<int> &entries = local_arena.entries;
+    std::vector<char *> &bufs = local_arena.bufs;
+    entries.resize(count);
+    bufs.resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        cache_writes++;
+        bufs[i] = (char *)data + (size_t)i * FS_BLOCKSIZE;
+        cache_shard_t &shard = Find_shard(blocks[i]);
+        std::unique_lock<std::mutex> shard_lock(shard.lock);
+        entries[i] = Write_entry(shard, blocks[i], shard_lock);
+        if (entries[i] == -1) {
+            Direct_write_begin(shard, blocks[i]);
+            continue;
+        }
+        cache_entry_t &entry = shard.entries[entries[i]];
+        memcpy(entry.data, bufs[i], FS_BLOCKSIZE);
+        entry.pin_count++;
+        Lru_push_front(shard, entries[i]);
+    }
+    Block_write_batch(count, blocks, (const char *const *)bufs.data());
+    for (uint32_t i = 0; i < count; i++) {
+        cache_shard_t &shard = Find_shard(blocks[i]);
+        std::unique_lock<std::mutex> shard_lock(shard.lock);
+        if (entries[i] == -1) Direct_write_end(shard, blocks[i]);
+        else shard.entries[entries[i]].pin_count--;
+    }
+}
+
+/*
+ *  Write every dirty block to disk as one group and return once they are all written.
+ *  The blocks are written by kind (data, inodes, direntries, directory inodes) so that a crash
+ *  in the middle never leaves a block pointing at another block that has not been written.
+ *  The flushed entries stay pinned until their write completes, so a miss cannot read the old
+ *  contents back from disk in between. The blocks freed by finished requests are taken with the
+ *  batch and only released once it is on disk, so a freed block is never written with new contents
+ *  before the block that pointed at it is written without the pointer.
+ *  Does nothing in write-through mode.
+ */
+void Cache_flush(){
+    if (!write_back_cache) return;
+    std::unique_lock<std::mutex> flush_guard(flush_lock);
+    std::vector<uint32_t> &batch = flush_batch;
+    std::vector<int> &kinds = flush_kinds;
+    batch.clear();
+    kinds.clear();
+    {
+        std::unique_lock<std::shared_mutex> commit_lock(cache_commit_lock);
+        {
+            std::unique_lock<std::mutex> list_lock(dirty_list_lock);
+            batch.swap(dirty_blocks);
+        }
+        Freed_blocks_take(flush_freed);
+        flush_buffer.resize(batch.size() * FS_BLOCKSIZE);
+        for (size_t i = 0; i < batch.size(); i++) {
+            cache_shard_t &shard = Find_shard(batch[i]);
+            std::unique_lock<std::mutex> shard_lock(shard.lock);
+            cache_entry_t &entry = shard.entries[shard.index.find(batch[i])];
+            memcpy(flush_buffer.data() + i * FS_BLOCKSIZE, entry.data, FS_BLOCKSIZE);
+            kinds.push_back(entry.kind);
+            entry.dirty = false;
+            entry.pin_count++;
+        }
+    }
+    if (batch.empty()) {
+        Freed_blocks_release(flush_freed);
+        flush_freed.clear();
+        return;
+    }
+    std::vector<size_t> &order = flush_order;
+    order.resize(batch.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b){
+        if (kinds[a] != kinds[b]) return kinds[a] < kinds[b];
+        return batch[a] < batch[b];
+    });
+    /*** Each kind is written as one batch, and only once the kinds before it are on disk ***/
+    std::vector<uint32_t> &group_blocks = flush_group_blocks;
+    std::vector<const char *> &group_bufs = flush_group_bufs;
+    group_blocks.clear();
+    group_bufs.clear();
+    for (size_t k = 0; k < order.size(); k++) {
+        size_t i = order[k];
+        group_blocks.push_back(batch[i]);
+        group_bufs.push_back(flush_buffer.data() + i * FS_BLOCKSIZE);
+        if (k + 1 == order.size() || kinds[order[k + 1]] != kinds[i]) {
+            Block_write_batch(group_blocks.size(), group_blocks.data(), group_bufs.data());
+            group_blocks.clear();
+            group_bufs.clear();
+        }
+    }
+    for (uint32_t block : batch) {
+        cache_shard_t &shard = Find_shard(block);
+        std::unique_lock<std::mutex> shard_lock(shard.lock);
+        shard.entries[shard.index.find(block)].pin_count--;
+    }
+    cache_flushes++;
+    cache_flushed_blocks += batch.size();
+    Freed_blocks_release(flush_freed);
+    flush_freed.clear();
+}
+
+/*
+ *  Background flusher of the write-back mode, it flushes every cache_flush_interval milliseconds
+ *  or as soon as half of the cache is dirty
+ */
+static void Flusher_running(){
+    std::unique_lock<std::mutex> wake_lock(flusher_lock);
+    while (!flusher_stopping) {
+        flusher_wake.wait_for(wake_lock, std::chrono::milliseconds(cache_flush_interval));
+        wake_lock.unlock();
+        Cache_flush();
+        wake_lock.lock();
+    }
+}
+
+/*
+ *  Stop the flusher and write every dirty block, called once no request is running anymore
+ */
+void Cache_shutdown(){
+    if (flusher_thread.joinable()){
+        {
+            std::unique_lock<std::mutex> wake_lock(flusher_lock);
+            flusher_stopping = true;
+        }
+        flusher_wake.notify_one();
+        flusher_thread.join();
+    }
+    Cache_flush();
+}
+
+/*
+ *  Keep a block in the cache until Cache_unpin is called, e.g. for the root inode
+ *  Returns false if the block could not be pinned because the shard is full of pinned entries
+ */
+bool Cache_pin(uint32_t block){
+    cache_shard_t &shard = Find_shard(block);
+    std::unique_lock<std::mutex> shard_lock(shard.lock);
+    return Load_entry(shard, block, shard_lock) != -1;
+}
+
+void Cache_unpin(uint32_t block){
+    cache_shard_t &shard = Find_shard(block);
+    std::unique_lock<std::mutex> shard_lock(shard.lock);
+    int found = shard.index.find(block);
+    if (found == -1 || shard.entries[found].pin_count == 0) throw SysError("Unpin a block that is not pinned");
+    shard.entries[found].pin_count--;
+}
+
+cache_stats_t Cache_get_stats(){
+    cache_stats_t stats;
+    stats.hits = cache_hits;
+    stats.misses = cache_misses;
+    stats.evictions = cache_evictions;
+    stats.writes = cache_writes;
+    stats.flushes = cache_flushes;
+    stats.flushed_blocks = cache_flushed_blocks;
+    stats.readahead_blocks = readahead_blocks;
+    stats.readahead_hits = readahead_hits;
+    stats.readahead_wasted = readahead_wasted;
+    return stats;
+}
+
+/*
+ *  Print the cache counters, used to size cache_capacity
+ */
+void Cache_print_stats(){
+    cache_stats_t stats = Cache_get_stats();
+    cout_lock.lock();
+    std::cout << "@@@ cache hits " << stats.hits << " misses " << stats.misses
+              << " evictions " << stats.evictions << " writes " << stats.writes
+              << " flushes " << stats.flushes << " flushed " << stats.flushed_blocks
+              << " readahead " << stats.readahead_blocks << " readahead hits " << stats.readahead_hits
+              << " readahead wasted " << stats.readahead_wasted << std::endl;
+    cout_lock.unlock();
+}
@@ -0,0 +1,54 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "global.h"
+
+/*
+ *  Hit/miss counters of the block cache, used to size it
+ */
+struct cache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writes;
+    uint64_t flushes;                       // write-back batches written
+    uint64_t flushed_blocks;                // blocks written by those batches
+    uint64_t readahead_blocks;              // blocks loaded by readahead
+    uint64_t readahead_hits;                // prefetched blocks later read by a request
+    uint64_t readahead_wasted;              // prefetched blocks evicted before any read
+};
+
+/*
+ *  Kind of a written block, in write-back mode a batch is written to disk in this order
+ *  so that blocks are on disk before anything pointing at them
+ */
+#define BLOCK_DATA      0                   // file data and the allocation bitmap
+#define BLOCK_INODE     1                   // file inodes and newly created inodes
+#define BLOCK_DIRENTRY  2                   // direntry blocks
+#define BLOCK_DIR_INODE 3                   // directory inodes whose block list changed
+
+void Cache_init();
+
+void Cache_readblock(uint32_t block, void *buf);
+
+void Cache_writeblock(uint32_t block, const void *buf, int kind);
+
+void Cache_flush();
+
+void Cache_shutdown();
+
+void Cache_readblocks(uint32_t count, const uint32_t *blocks, void *buf);
+
+void Cache_writeblocks(uint32_t count, const uint32_t *blocks, const void *buf, int kind);
+
+void Cache_prefetch(uint32_t count, const uint32_t *blocks);
+
+bool Cache_pin(uint32_t block);
+
+void Cache_unpin(uint32_t block);
+
+cache_stats_t Cache_get_stats();
+
+void Cache_print_stats();
+
+#endif /* _CACHE_H_ */
@@ -0,0 +1,66 @@
+#include "dentry.h"
+
+extern const unsigned int dentry_cache_capacity;
+
+static const unsigned int DENTRY_SHARD_COUNT = 16;
+
+/*
+ *  Cached result of one path walk.
+ *  Every directory above the path was checked to be a directory owned by username (or the root),
+ *  owners never change, so the entry stays valid until the path itself is deleted.
+ */
+struct dentry_t {
+    uint32_t inode_block;
+    inline_string_t<FS_MAXUSERNAME> username;   // user the walk was checked for
+};
+
+/*
+ *  Paths are kept inline, so a lookup builds its key without allocating
+ */
+typedef inline_string_t<FS_MAXPATHNAME> dentry_path_t;
+
+struct dentry_shard_t {
+    std::mutex lock;
+    std::unordered_map<dentry_path_t, dentry_t, inline_string_hash_t<FS_MAXPATHNAME>> paths;
+};
+
+static dentry_shard_t dentry_shards[DENTRY_SHARD_COUNT];
+
+static dentry_shard_t &Find_dentry_shard(std::string_view path){
+    return dentry_shards[std::hash<std::string_view>()(path) % DENTRY_SHARD_COUNT];
+}
+
+/*
+ *  Look up the inode block of path as resolved for username
+ *  The result is only a hint until the caller holds the lock of inode_block and looked it up again:
+ *  entries are erased while the deleted inode is locked exclusively, so an entry found while
+ *  holding that lock is current.
+ */
+bool Dentry_lookup(std::string_view path, std::string_view username, uint32_t &inode_block){
+    dentry_shard_t &shard = Find_dentry_shard(path);
+    std::unique_lock<std::mutex> shard_lock(shard.lock);
+    auto it = shard.paths.find(dentry_path_t(path));
+    if (it == shard.paths.end() || it->second.username.view() != username) return false;
+    inode_block = it->second.inode_block;
+    return true;
+}
+
+/*
+ *  Record the result of a path walk, the caller must still hold the lock of inode_block
+ */
+void Dentry_insert(std::string_view path, std::string_view username, uint32_t inode_block){
+    dentry_shard_t &shard = Find_dentry_shard(path);
+    std::unique_lock<std::mutex> shard_lock(shard.lock);
+    if (shard.paths.size() >= dentry_cache_capacity / DENTRY_SHARD_COUNT) shard.paths.clear();
+    shard.paths[dentry_path_t(path)] = dentry_t{inode_block, inline_string_t<FS_MAXUSERNAME>(username)};
+}
+
+/*
+ *  Forget a deleted path, the caller must hold the exclusive lock of its inode
+ *  Only empty directories can be deleted, so no path below it can be cached
+ */
+void Dentry_erase(std::string_view path){
+    dentry_shard_t &shard = Find_dentry_shard(path);
+    std::unique_lock<std::mutex> shard_lock(shard.lock);
+    shard.paths.erase(dentry_path_t(path));
+}
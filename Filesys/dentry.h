@@ -0,0 +1,12 @@
+#ifndef _DENTRY_H_
+#define _DENTRY_H_
+
+#include "global.h"
+
+bool Dentry_lookup(std::string_view path, std::string_view username, uint32_t &inode_block);
+
+void Dentry_insert(std::string_view path, std::string_view username, uint32_t inode_block);
+
+void Dentry_erase(std::string_view path);
+
+#endif /* _DENTRY_H_ */
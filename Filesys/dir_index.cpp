@@ -0,0 +1,173 @@
+#include "dir_index.h"
+#include "cache.h"
+
+extern const unsigned int dir_index_capacity;
+
+static const unsigned int DIR_INDEX_SHARD_COUNT = 16;
+
+/*
+ *  Names are kept inline, so looking one up never allocates
+ */
+typedef inline_string_t<FS_MAXFILENAME> dir_name_t;
+
+static_assert(FS_DIRENTRIES <= 32, "the used slots of a direntry block must fit in a uint32_t");
+
+static const uint32_t DIR_BLOCK_FULL = (FS_DIRENTRIES == 32) ? 0xffffffffu : ((1u << FS_DIRENTRIES) - 1);
+
+/*
+ *  In-memory name index of one directory.
+ *  It is built from the direntry blocks the first time the directory is searched,
+ *  and afterwards kept coherent by Create/Delete through Dir_index_insert/Dir_index_remove.
+ *  used_slots[i] has bit j set when slot j of the i-th direntry block is used, so Create finds
+ *  a free slot without reading the direntry blocks.
+ */
+struct dir_index_t {
+    std::mutex lock;
+    bool built = false;
+    std::unordered_map<dir_name_t, dir_slot_t, inline_string_hash_t<FS_MAXFILENAME>> names;
+    std::vector<uint32_t> used_slots;
+};
+
+/*
+ *  The indexes are split into shards by directory, each keeping at most its share of
+ *  dir_index_capacity indexes in least recently used order.
+ *  An evicted index is rebuilt from the direntry blocks the next time its directory is searched.
+ *  A request still holding it keeps using it: every change of a directory is made under its
+ *  exclusive lock, which also keeps the new index from being built until the change is on disk.
+ */
+struct dir_index_entry_t {
+    std::shared_ptr<dir_index_t> index;
+    std::list<uint32_t>::iterator lru_position;
+};
+
+struct dir_index_shard_t {
+    std::mutex lock;
+    std::unordered_map<uint32_t, dir_index_entry_t> indexes;
+    std::list<uint32_t> lru;                // most recently used directory first
+};
+
+static dir_index_shard_t dir_index_shards[DIR_INDEX_SHARD_COUNT];
+
+static dir_index_shard_t &Find_dir_index_shard(uint32_t dir_inode_id){
+    return dir_index_shards[dir_inode_id % DIR_INDEX_SHARD_COUNT];
+}
+
+/*
+ *  Find the index of a directory, creating an empty (not yet built) one if needed
+ */
+static std::shared_ptr<dir_index_t> Find_dir_index(uint32_t dir_inode_id){
+    dir_index_shard_t &shard = Find_dir_index_shard(dir_inode_id);
+    std::unique_lock<std::mutex> shard_lock(shard.lock);
+    auto it = shard.indexes.find(dir_inode_id);
+    if (it != shard.indexes.end()) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru_position);
+        return it->second.index;
+    }
+    if (shard.indexes.size() >= std::max(1u, dir_index_capacity / DIR_INDEX_SHARD_COUNT)) {
+        shard.indexes.erase(shard.lru.back());
+        shard.lru.pop_back();
+    }
+    shard.lru.push_front(dir_inode_id);
+    std::shared_ptr<dir_index_t> index = std::make_shared<dir_index_t>();
+    shard.indexes.emplace(dir_inode_id, dir_index_entry_t{index, shard.lru.begin()});
+    return index;
+}
+
+/*
+ *  Scan every direntry block of the directory once and record all used names
+ */
+static void Build_dir_index(dir_index_t &index, const fs_inode &dir_inode){
+    index.used_slots.assign(dir_inode.size, 0);
+    for (uint32_t i = 0; i < dir_inode.size; i++) {
+        direntry_node_t dire_node;
+        Cache_readblock(dir_inode.blocks[i], &dire_node.directory);
+        for (unsigned int j = 0; j < FS_DIRENTRIES; j++) {
+            if (dire_node.directory[j].inode_block == 0) continue;
+            const char *name = dire_node.directory[j].name;
+            dir_slot_t slot = {dir_inode.blocks[i], i, j, dire_node.directory[j].inode_block};
+            index.names.emplace(dir_name_t(std::string_view(name, strnlen(name, FS_MAXFILENAME))), slot);
+            index.used_slots[i] |= 1u << j;
+        }
+    }
+    index.built = true;
+}
+
+/*
+ *  Look up name in the directory whose inode is dir_inode (stored in block dir_inode_id)
+ *  The caller must hold the lock of the directory.
+ *  Returns true and fills found if the name exists.
+ */
+bool Dir_index_lookup(uint32_t dir_inode_id, const fs_inode &dir_inode, std::string_view name, dir_slot_t &found){
+    std::shared_ptr<dir_index_t> index = Find_dir_index(dir_inode_id);
+    std::unique_lock<std::mutex> index_lock(index->lock);
+    if (!index->built) Build_dir_index(*index, dir_inode);
+    auto it = index->names.find(dir_name_t(name));
+    if (it == index->names.end()) return false;
+    found = it->second;
+    return true;
+}
+
+/*
+ *  Record a direntry that has just been written to disk.
+ *  A slot at position used_slots.size() is in a direntry block just appended to the directory.
+ */
+void Dir_index_insert(uint32_t dir_inode_id, std::string_view name, dir_slot_t slot){
+    std::shared_ptr<dir_index_t> index = Find_dir_index(dir_inode_id);
+    std::unique_lock<std::mutex> index_lock(index->lock);
+    if (!index->built) return;
+    index->names[dir_name_t(name)] = slot;
+    if (slot.position == index->used_slots.size()) index->used_slots.push_back(0);
+    index->used_slots[slot.position] |= 1u << slot.slot;
+}
+
+/*
+ *  Forget a direntry that is being cleared, its slot becomes free.
+ *  The caller must hold the exclusive lock of the directory and not have written the cleared
+ *  direntry yet, so an index built here still finds it.
+ *  Then drop the empty direntry blocks at the end of the directory and return how many blocks remain.
+ *  Empty blocks in the middle are kept for later creates, so the last block of a directory
+ *  is never empty and an empty directory has size 0.
+ */
+uint32_t Dir_index_remove(uint32_t dir_inode_id, const fs_inode &dir_inode, std::string_view name){
+    std::shared_ptr<dir_index_t> index = Find_dir_index(dir_inode_id);
+    std::unique_lock<std::mutex> index_lock(index->lock);
+    if (!index->built) Build_dir_index(*index, dir_inode);
+    auto it = index->names.find(dir_name_t(name));
+    if (it != index->names.end()) {
+        if (it->second.position < index->used_slots.size()) {
+            index->used_slots[it->second.position] &= ~(1u << it->second.slot);
+        }
+        index->names.erase(it);
+    }
+    while (!index->used_slots.empty() && index->used_slots.back() == 0) index->used_slots.pop_back();
+    return index->used_slots.size();
+}
+
+/*
+ *  Find a free slot in the existing direntry blocks of the directory, the lowest one first.
+ *  The caller must hold the exclusive lock of the directory.
+ *  Returns false if every direntry block is full.
+ */
+bool Dir_index_free_slot(uint32_t dir_inode_id, const fs_inode &dir_inode, dir_slot_t &free_slot){
+    std::shared_ptr<dir_index_t> index = Find_dir_index(dir_inode_id);
+    std::unique_lock<std::mutex> index_lock(index->lock);
+    if (!index->built) Build_dir_index(*index, dir_inode);
+    for (uint32_t i = 0; i < index->used_slots.size(); i++) {
+        if (index->used_slots[i] == DIR_BLOCK_FULL) continue;
+        free_slot = {dir_inode.blocks[i], i, (unsigned int)__builtin_ctz(~index->used_slots[i]), 0};
+        return true;
+    }
+    return false;
+}
+
+/*
+ *  Drop the whole index of a deleted directory, its inode block may be reused later
+ */
+void Dir_index_drop(uint32_t dir_inode_id){
+    dir_index_shard_t &shard = Find_dir_index_shard(dir_inode_id);
+    std::unique_lock<std::mutex> shard_lock(shard.lock);
+    auto it = shard.indexes.find(dir_inode_id);
+    if (it == shard.indexes.end()) return;
+    shard.lru.erase(it->second.lru_position);
+    shard.indexes.erase(it);
+}
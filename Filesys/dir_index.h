@@ -0,0 +1,26 @@
+#ifndef _DIR_INDEX_H_
+#define _DIR_INDEX_H_
+
+#include "global.h"
+
+/*
+ *  Location of a used direntry inside a directory
+ */
+struct dir_slot_t {
+    uint32_t block;                         // disk block holding the direntry
+    uint32_t position;                      // index of that block in the blocks of the directory
+    unsigned int slot;                      // index of the direntry inside the block
+    uint32_t inode_block;                   // inode block the direntry points to
+};
+
+bool Dir_index_lookup(uint32_t dir_inode_id, const fs_inode &dir_inode, std::string_view name, dir_slot_t &found);
+
+void Dir_index_insert(uint32_t dir_inode_id, std::string_view name, dir_slot_t slot);
+
+uint32_t Dir_index_remove(uint32_t dir_inode_id, const fs_inode &dir_inode, std::string_view name);
+
+bool Dir_index_free_slot(uint32_t dir_inode_id, const fs_inode &dir_inode, dir_slot_t &free_slot);
+
+void Dir_index_drop(uint32_t dir_inode_id);
+
+#endif /* _DIR_INDEX_H_ */
@@ -3,22 +3,50 @@
 extern const int listen_queue_length;
 extern const int max_message_length;
 extern const int max_send_message_length;
-extern bool disk_block[FS_DISKSIZE];
-extern std::mutex disk_block_lock[FS_DISKSIZE];
-extern std::mutex free_block_lock;
 
 
 /*
  * Filesystem_init() preprocess the existing file system, and set all the currently used disk blocks not free
+ * With the on-disk bitmap enabled and saved by a clean shutdown, only the bitmap blocks are read.
+ * Otherwise the whole directory tree is walked, which also repairs the on-disk bitmap.
  */
 void Filesystem_init(){
+    Block_io_init();
+    Block_lock_init();
+    Alloc_init();
+    Cache_init();
+    Cache_pin(0); /*** Every request starts its path walk at the root inode, so keep it cached ***/
+    if (!persistent_bitmap || !Bitmap_region_load()) {
+        Filesystem_walk();
+        if (persistent_bitmap) Bitmap_region_attach();
+        else Bitmap_region_invalidate();
+    }
+    Readahead_start();
+}
+
+/*
+ * Filesystem_shutdown() is called once every request has finished, it leaves the disk consistent
+ * for a fast restart
+ */
+void Filesystem_shutdown(){
+    Readahead_stop();
+    /*** Release the blocks freed since the last flush before the bitmap is saved ***/
+    Cache_flush();
+    Bitmap_region_close();
+    Cache_shutdown();
+}
+
+/*
+ * Filesystem_walk() walks the whole directory tree and marks every block it reaches as used
+ */
+void Filesystem_walk(){
     Set_disk_block_status(0, false); /*** Disk block 0 is the root_inode and it is never free ***/
-    for (uint32_t i = 1 ; i < FS_DISKSIZE; i++) {
+    for (uint32_t i = 1 ; i < disk_size; i++) {
         Set_disk_block_status(i, true);
     }
     std::queue<uint32_t> used_direntry;
     struct fs_inode root_inode;
-    disk_readblock(0, &root_inode);
+    Cache_readblock(0, &root_inode);
     for (uint32_t i = 0; i < root_inode.size; i++) {
         used_direntry.push(root_inode.blocks[i]);
         Set_disk_block_status(root_inode.blocks[i], false);
@@ -27,7 +55,7 @@ void Filesystem_init(){
         uint32_t curr_direntry = used_direntry.front();
         used_direntry.pop();
         direntry_node_t dire_node;
-        disk_readblock(curr_direntry, &dire_node.directory);
+        Cache_readblock(curr_direntry, &dire_node.directory);
         for (uint32_t i = 0 ; i < FS_DIRENTRIES; i++) {
             uint32_t curr_inode_id = dire_node.directory[i].inode_block;
             if (curr_inode_id == 0){
@@ -36,12 +64,12 @@ void Filesystem_init(){
             }
             Set_disk_block_status(curr_inode_id, false);
             struct fs_inode curr_inode;
-            disk_readblock(curr_inode_id, &curr_inode);
+            Cache_readblock(curr_inode_id, &curr_inode);
 
-            if (curr_inode.type == 'f'){
-                for (uint32_t i = 0; i < curr_inode.size; i++) {
-                    Set_disk_block_status(curr_inode.blocks[i], false);
-                }
+            if (Is_file_type(curr_inode.type)){
+                inode_map_t curr_map;
+                Inode_map_load(curr_map, curr_inode_id);
+                Inode_map_set_status(curr_map, false);
             }
             else if (curr_inode.type == 'd'){
                 for (uint32_t i = 0; i < curr_inode.size; i++) {
@@ -53,19 +81,90 @@ void Filesystem_init(){
     }
 }
 
+/*
+ *  Per-worker scratch list of disk blocks for READBLOCKS/WRITEBLOCKS.
+ *  It only grows, so a request no longer than the ones before it does not allocate.
+ */
+static thread_local std::vector<uint32_t> disk_block_arena;
+
+/*
+ *  Number of lock-free tries of a read before it takes the locks
+ */
+static const int optimistic_read_attempts = 2;
+
+/*
+ *  Read client_request.count blocks of the file stored in target_inode_id into the request,
+ *  READ into data and READBLOCKS into blocks_data
+ */
+static void Read_file_blocks(request_t &client_request, uint32_t target_inode_id, inode_map_t &target_map){
+    Inode_map_load(target_map, target_inode_id);
+    CheckUserValid(target_map.inode, client_request.username);
+    CheckFileType(target_map.inode);
+    CheckBlockOverflow(target_map.inode, client_request.block + client_request.count - 1);
+    if (Inode_map_inline(target_map)) {
+        /*** The data came with the inode, and an inline file has block 0 only ***/
+        if (client_request.request_type == READ) Inode_map_read_inline(target_map, client_request.data);
+        else {
+            client_request.blocks_data.resize(FS_BLOCKSIZE);
+            Inode_map_read_inline(target_map, client_request.blocks_data.data());
+        }
+        return;
+    }
+    if (client_request.request_type == READ) {
+        Cache_readblock(Inode_map_block(target_map, client_request.block), client_request.data);
+        return;
+    }
+    std::vector<uint32_t> &disk_blocks = disk_block_arena;
+    disk_blocks.resize(client_request.count);
+    Inode_map_range(target_map, client_request.block, client_request.count, disk_blocks.data());
+    client_request.blocks_data.resize(client_request.count * FS_BLOCKSIZE);
+    Cache_readblocks(client_request.count, disk_blocks.data(), client_request.blocks_data.data());
+}
+
+/*
+ *  Serve a READ/READBLOCKS without taking any block lock, like a seqlock reader.
+ *  The path must be in the dentry cache. The version of the file inode is read before and after,
+ *  and since every writer of the file holds its lock exclusively, an unchanged even version means
+ *  the reads saw one consistent state. A failure is only reported once it is validated the same way.
+ *  Returns false if the path is not cached or a writer got in the way, the caller then takes the locks.
+ */
+static bool Optimistic_read(request_t &client_request, inode_map_t &target_map){
+    std::string_view username(client_request.username, client_request.username_length);
+    std::string_view target_path(client_request.pathname, client_request.pathname_length);
+    uint32_t target_inode_id, current_inode_id;
+    uint64_t version;
+    if (!Dentry_lookup(target_path, username, target_inode_id)) return false;
+    if (!Block_version_begin(target_inode_id, version)) return false;
+    /*** Look up again: a delete erases the path before its version goes even again ***/
+    if (!Dentry_lookup(target_path, username, current_inode_id) || current_inode_id != target_inode_id) return false;
+    try{
+        Read_file_blocks(client_request, target_inode_id, target_map);
+    }
+    catch (SysError &){
+        if (Block_version_validate(target_inode_id, version)) throw;
+        return false;
+    }
+    return Block_version_validate(target_inode_id, version);
+}
+
 /* 
  *  This function will serve the client request type READBLOCK
+ *  It first tries without locks, see Optimistic_read
  */
 void ReadBlock_helper(request_t &client_request){
     TestPrint("---------- Read Begin ---------- ", client_request.block);
-    std::unique_lock<std::mutex> curr_mutex(disk_block_lock[0]);
-    uint32_t target_inode_id = Find_target_inode(client_request, curr_mutex);
-    fs_inode target_inode;
-    disk_readblock(target_inode_id, &target_inode);
-    CheckUserValid(target_inode, client_request.username);
-    CheckInodeType(target_inode, 'f');
-    CheckBlockOverflow(target_inode, client_request.block);
-    disk_readblock(target_inode.blocks[client_request.block], client_request.data);
+    inode_map_t target_map;
+    for (int attempt = 0; attempt < optimistic_read_attempts; attempt++) {
+        if (Optimistic_read(client_request, target_map)) {
+            Readahead_access(target_map, client_request.block, 1);
+            TestPrint("---------- Read End ---------- ", client_request.block);
+            return;
+        }
+    }
+    block_lock_t target_lock;
+    uint32_t target_inode_id = Find_target_inode(client_request, target_lock);
+    Read_file_blocks(client_request, target_inode_id, target_map);
+    Readahead_access(target_map, client_request.block, 1);
     TestPrint("---------- Read End ---------- ", client_request.block);
 }
 
@@ -74,108 +173,160 @@ void ReadBlock_helper(request_t &client_request){
  */
 void WriteBlock_helper(request_t &client_request){
     TestPrint("---------- Write Begin ---------- ", client_request.block);
-    std::unique_lock<std::mutex> curr_mutex(disk_block_lock[0]);
-    uint32_t target_inode_id = Find_target_inode(client_request, curr_mutex);
-    fs_inode target_inode;
-    disk_readblock(target_inode_id, &target_inode);
-    uint32_t write_disk_block;
+    block_lock_t target_lock;
+    uint32_t target_inode_id = Find_target_inode(client_request, target_lock);
+    inode_map_t target_map;
+    Inode_map_load(target_map, target_inode_id);
     char data[FS_BLOCKSIZE];
-    CheckUserValid(target_inode, client_request.username);
-    CheckInodeType(target_inode, 'f');
-    if (client_request.block < target_inode.size){ 
+    CheckUserValid(target_map.inode, client_request.username);
+    CheckFileType(target_map.inode);
+    memcpy(data, client_request.data, FS_BLOCKSIZE);
+    if (Inode_map_write_inline(target_map, client_request.block, 1, data)) {
+        /*** A small file is written with its inode alone ***/
+        Inode_map_store(target_map);
+        TestPrint("---------- Write End ---------- ", client_request.block);
+        return;
+    }
+    if (client_request.block < target_map.inode.size){ 
         /*** We write to an existing block ***/
-        write_disk_block = target_inode.blocks[client_request.block];
-        memcpy(data, client_request.data, FS_BLOCKSIZE);
-        CheckBlockOverflow(target_inode, client_request.block);
-        disk_writeblock(write_disk_block, data);
+        Cache_writeblock(Inode_map_block(target_map, client_request.block), data, BLOCK_DATA);
     }
     else { 
         /*** We create a block immediately after the current end of the file ***/
-        if (target_inode.size == FS_MAXFILEBLOCKS) throw SysError("File blocks are maximal");
-        target_inode.size ++;
-        CheckBlockOverflow(target_inode, client_request.block);
-        write_disk_block = Find_free_disk_block();
-        target_inode.blocks[client_request.block] = write_disk_block;
-        memcpy(data, client_request.data, FS_BLOCKSIZE);
-        disk_writeblock(write_disk_block, data);
-        disk_writeblock(target_inode_id, &target_inode);
+        if (client_request.block != target_map.inode.size) throw SysError("Block index overflow");
+        Inode_map_extend(target_map, target_map.inode.size + 1);
+        Cache_writeblock(Inode_map_block(target_map, client_request.block), data, BLOCK_DATA);
+        Inode_map_store(target_map);
     }
     TestPrint("---------- Write End ---------- ", client_request.block);
 }
 
+/* 
+ *  This function will serve the client request type READBLOCKS
+ *  It reads count contiguous file blocks starting at block, with a single path walk and inode read,
+ *  first without locks like READBLOCK
+ */
+void ReadBlocks_helper(request_t &client_request){
+    TestPrint("---------- Read Blocks Begin ---------- ", client_request.block);
+    inode_map_t target_map;
+    for (int attempt = 0; attempt < optimistic_read_attempts; attempt++) {
+        if (Optimistic_read(client_request, target_map)) {
+            Readahead_access(target_map, client_request.block, client_request.count);
+            TestPrint("---------- Read Blocks End ---------- ", client_request.block);
+            return;
+        }
+    }
+    block_lock_t target_lock;
+    uint32_t target_inode_id = Find_target_inode(client_request, target_lock);
+    Read_file_blocks(client_request, target_inode_id, target_map);
+    Readahead_access(target_map, client_request.block, client_request.count);
+    TestPrint("---------- Read Blocks End ---------- ", client_request.block);
+}
+
+/* 
+ *  This function will serve the client request type WRITEBLOCKS
+ *  The range may overwrite existing blocks and extend the file, as long as it starts at or before
+ *  the current end of the file. Blocks for the appended part are allocated in one batch, and the
+ *  inode is written once after the data.
+ */
+void WriteBlocks_helper(request_t &client_request){
+    TestPrint("---------- Write Blocks Begin ---------- ", client_request.block);
+    block_lock_t target_lock;
+    uint32_t target_inode_id = Find_target_inode(client_request, target_lock);
+    inode_map_t target_map;
+    Inode_map_load(target_map, target_inode_id);
+    CheckUserValid(target_map.inode, client_request.username);
+    CheckFileType(target_map.inode);
+    if (client_request.block > target_map.inode.size) throw SysError("Block index overflow");
+    if (Inode_map_write_inline(target_map, client_request.block, client_request.count, client_request.blocks_data.data())) {
+        Inode_map_store(target_map);
+        TestPrint("---------- Write Blocks End ---------- ", client_request.block);
+        return;
+    }
+    uint32_t end_block = client_request.block + client_request.count;
+    uint32_t old_size = target_map.inode.size;
+    /*** Allocate every appended block at once, nothing is written if the disk is full ***/
+    Inode_map_extend(target_map, end_block);
+    std::vector<uint32_t> &disk_blocks = disk_block_arena;
+    disk_blocks.resize(client_request.count);
+    Inode_map_range(target_map, client_request.block, client_request.count, disk_blocks.data());
+    Cache_writeblocks(client_request.count, disk_blocks.data(), client_request.blocks_data.data(), BLOCK_DATA);
+    if (target_map.inode.size != old_size) {
+        Inode_map_store(target_map);
+    }
+    TestPrint("---------- Write Blocks End ---------- ", client_request.block);
+}
+
 /* 
  *  This function will serve the client request type CREATE. 
- *  If CREATE fails, the original occupied disk block would be set free
+ *  free_inode is set as soon as the new inode is taken, Create_helper frees it again if CREATE fails
  */
-void Create_attempt(request_t &client_request, uint32_t free_inode){
-    std::vector<std::string> filename_set = Pathname_Parsing(client_request.pathname);
-    std::string filename = filename_set[filename_set.size()-1];
-    std::unique_lock<std::mutex> curr_mutex(disk_block_lock[0]);
-    uint32_t target_inode_id = Find_target_inode(client_request, curr_mutex);
+void Create_attempt(request_t &client_request, uint32_t &free_inode){
+    path_components_t filename_set;
+    Pathname_Parsing(std::string_view(client_request.pathname, client_request.pathname_length), filename_set);
+    std::string_view filename = filename_set.names[filename_set.count - 1];
+    block_lock_t target_lock;
+    uint32_t target_inode_id = Find_target_inode(client_request, target_lock);
     fs_inode target_inode;
-    disk_readblock(target_inode_id, &target_inode);
+    Cache_readblock(target_inode_id, &target_inode);
     CheckUserValid(target_inode, client_request.username);
     CheckInodeType(target_inode, 'd');
-    direntry_node_t dire_node;
+    dir_slot_t existing_slot;
+    if (Dir_index_lookup(target_inode_id, target_inode, filename, existing_slot)) throw SysError("Cannot create since filename already exist in the path");
+    /*** A file goes next to its directory, a directory to a group with room for its contents ***/
+    free_inode = Find_free_disk_block((client_request.type == 'd') ? Find_directory_goal() : target_inode_id);
     direntry_node_t target_dire_node;
-    bool if_created = false;
-    uint32_t dire_block_node = 0;   // disk block id for the fs_dire
-    unsigned int dire_index = 0;    // index for the position in fs_dire
+    dir_slot_t free_slot;
+    bool if_created = Dir_index_free_slot(target_inode_id, target_inode, free_slot);
     TestPrint("---------- Target Inode Size ---------- ", target_inode.size);
-    for (uint32_t i = 0; i < target_inode.size; i++) {
-        disk_readblock(target_inode.blocks[i], &dire_node.directory);
-        for (unsigned int j = 0; j < FS_DIRENTRIES; j++) {
-            if (dire_node.directory[j].inode_block != 0 && std::string(dire_node.directory[j].name) == filename) throw SysError("Cannot create since filename already exist in the path");
-            if (!if_created && dire_node.directory[j].inode_block == 0) {
-                dire_block_node = target_inode.blocks[i];
-                dire_index = j;
-                if_created = true;
-                for (unsigned int k = 0; k < FS_DIRENTRIES; k++) {
-                    target_dire_node.directory[k] = dire_node.directory[k];
-                }
-            }
-        }
+    if (if_created) {
+        /*** Reuse a free slot of an existing direntry block ***/
+        Cache_readblock(free_slot.block, &target_dire_node.directory);
     }
-    if (!if_created){
+    else {
         if (target_inode.size == FS_MAXFILEBLOCKS) throw SysError("No more file blocks for the directory");
-        uint32_t free_direntry = Find_free_disk_block();
+        uint32_t free_direntry = Find_free_disk_block(target_inode_id);
         for (unsigned int i=0; i<FS_DIRENTRIES; i++) {
             target_dire_node.directory[i].inode_block = 0;
         }
         target_inode.blocks[target_inode.size] = free_direntry;
+        free_slot = {free_direntry, target_inode.size, 0, 0};
         target_inode.size++;
-        dire_block_node = free_direntry;
-        dire_index = 0;
     }
+    uint32_t dire_block_node = free_slot.block;   // disk block id for the fs_dire
+    unsigned int dire_index = free_slot.slot;     // index for the position in fs_dire
     /*** Create a new inode ***/
     fs_inode new_inode;
+    memset(&new_inode, 0, sizeof(new_inode));
     new_inode.type = client_request.type;
-    strcpy(new_inode.owner, client_request.username.c_str());
+    strcpy(new_inode.owner, client_request.username);
     new_inode.size = 0;
     /*** Create a new direntory node ***/
     target_dire_node.directory[dire_index].inode_block = free_inode;
-    strcpy(target_dire_node.directory[dire_index].name, filename.c_str());
-    std::unique_lock<std::mutex> create_mutex(disk_block_lock[free_inode]);
-    disk_writeblock(free_inode, &new_inode);
-    disk_writeblock(dire_block_node, &target_dire_node.directory);
+    memcpy(target_dire_node.directory[dire_index].name, filename.data(), filename.length());
+    target_dire_node.directory[dire_index].name[filename.length()] = '\0';
+    /*** The new inode needs no lock: nobody reaches it before its direntry is written under the directory lock ***/
+    Cache_writeblock(free_inode, &new_inode, BLOCK_INODE);
+    Cache_writeblock(dire_block_node, &target_dire_node.directory, BLOCK_DIRENTRY);
     if (!if_created) {
-        disk_writeblock(target_inode_id, &target_inode);
+        Cache_writeblock(target_inode_id, &target_inode, BLOCK_DIR_INODE);
     }
+    Dir_index_insert(target_inode_id, filename, {dire_block_node, free_slot.position, dire_index, free_inode});
 }
 
 /* 
  *  This function will serve the client request type CREATE. 
- *  We first set one free disk block and call Create_attempt.
+ *  Create_attempt takes a free disk block for the new inode once it knows the directory.
  *  If attempt fails, we free the occupied disk block
  */
 void Create_helper(request_t &client_request){
     TestPrint("---------- Create Begin ---------- ", 0);
-    uint32_t free_inode = Find_free_disk_block();
+    uint32_t free_inode = 0; /*** Block 0 is the root inode, never handed out ***/
     try{
         Create_attempt(client_request, free_inode);
     }
     catch(SysError e){
-        Set_disk_block_status(free_inode, true);
+        if (free_inode != 0) Set_disk_block_status(free_inode, true);
         throw e;
     }
     TestPrint("---------- Create End ---------- ", 0);
@@ -183,47 +334,50 @@ void Create_helper(request_t &client_request){
 
 /* 
  *  This function will serve the client request type DELETE
- *  If we can find a file to delete, the function will return true
- *  Otherwise, return false
+ *  It deletes the direntry in slot j of the i-th direntry block of the directory, whose lock is target_lock.
+ *  A direntry block that becomes empty is kept for later creates unless it is the last one.
+ *  Returns false, with nothing changed, if the deleted inode could not be locked while holding the
+ *  directory (see block_lock_t::lock_next), busy_block is then the inode to wait for.
  */
-bool Delete_attempt(request_t &client_request, uint32_t i, int target_inode_id, fs_inode target_inode, std::string filename){
+bool Delete_attempt(request_t &client_request, uint32_t i, unsigned int j, int target_inode_id, fs_inode &target_inode, std::string_view filename,
+                    const block_lock_t &target_lock, uint32_t &busy_block){
     direntry_node_t dire_node;
-    disk_readblock(target_inode.blocks[i], &dire_node.directory);
-    for (unsigned int j = 0; j < FS_DIRENTRIES; j++) {
-        if (dire_node.directory[j].inode_block != 0 && std::string(dire_node.directory[j].name) == filename) {
-            uint32_t delete_inode_id = dire_node.directory[j].inode_block;
-            fs_inode delete_inode;
-            std::unique_lock<std::mutex> delete_mutex(disk_block_lock[delete_inode_id]);
-            disk_readblock(delete_inode_id, &delete_inode);
-            CheckUserValid(delete_inode, client_request.username);
-
-            if (delete_inode.type == 'd' && delete_inode.size > 0) throw SysError("Cannot delete non-empty directory");
-            if (delete_inode.type == 'f') {
-                for (uint32_t k = 0; k < delete_inode.size; k++) {
-                    Set_disk_block_status(delete_inode.blocks[k], true);
-                }
-            }
-            dire_node.directory[j].inode_block = 0;   
-            Set_disk_block_status(delete_inode_id, true);
-            /*** Determine whether the current direntry is empty ***/
-            for (unsigned int k = 0; k < FS_DIRENTRIES; k++) {
-                if (dire_node.directory[k].inode_block != 0) {
-                    /*** The direntry is not empty, we write the direntry back to disk and return ***/
-                    disk_writeblock(target_inode.blocks[i], &dire_node.directory);
-                    return true;
-                }
-            }
-            /*** The direntry is empty, we set the disk block to free, and move the later direntries forward ***/
-            Set_disk_block_status(target_inode.blocks[i], true);
-            for (uint32_t k = i + 1; k < target_inode.size; k++){
-                target_inode.blocks[k - 1] = target_inode.blocks[k];
-            }
-            target_inode.size--;
-            disk_writeblock(target_inode_id, &target_inode);
-            return true;
-        }
+    Cache_readblock(target_inode.blocks[i], &dire_node.directory);
+    std::string_view dire_name(dire_node.directory[j].name, strnlen(dire_node.directory[j].name, FS_MAXFILENAME + 1));
+    if (dire_node.directory[j].inode_block == 0 || dire_name != filename) throw SysError("Directory index is out of date");
+    uint32_t delete_inode_id = dire_node.directory[j].inode_block;
+    fs_inode delete_inode;
+    block_lock_t delete_lock;
+    if (!delete_lock.lock_next(target_lock, delete_inode_id, true)) {
+        busy_block = delete_inode_id;
+        return false;
     }
-    return false;
+    Cache_readblock(delete_inode_id, &delete_inode);
+    CheckUserValid(delete_inode, client_request.username);
+
+    if (delete_inode.type == 'd' && delete_inode.size > 0) throw SysError("Cannot delete non-empty directory");
+    if (Is_file_type(delete_inode.type)) {
+        inode_map_t delete_map;
+        Inode_map_load(delete_map, delete_inode_id);
+        Inode_map_set_status(delete_map, true);
+    }
+    dire_node.directory[j].inode_block = 0;
+    Free_disk_block(delete_inode_id);
+    uint32_t new_size = Dir_index_remove(target_inode_id, target_inode, filename);
+    Dentry_erase(std::string_view(client_request.pathname, client_request.pathname_length));
+    if (delete_inode.type == 'd') Dir_index_drop(delete_inode_id);
+    /*** The slot is only marked free, the other direntries stay where they are ***/
+    if (new_size == target_inode.size) {
+        Cache_writeblock(target_inode.blocks[i], &dire_node.directory, BLOCK_DIRENTRY);
+        return true;
+    }
+    /*** The last direntry block became empty, we free it and every empty block before it ***/
+    for (uint32_t k = new_size; k < target_inode.size; k++) {
+        Free_disk_block(target_inode.blocks[k]);
+    }
+    target_inode.size = new_size;
+    Cache_writeblock(target_inode_id, &target_inode, BLOCK_DIR_INODE);
+    return true;
 }
 
 
@@ -233,22 +387,27 @@ bool Delete_attempt(request_t &client_request, uint32_t i, int target_inode_id,
  */
 void Delete_helper(request_t &client_request){
     TestPrint("---------- Delete Begin ---------- ", 0);
-    if (client_request.pathname == "/") throw SysError("Cannot delete root node");
-    std::vector<std::string> filename_set = Pathname_Parsing(client_request.pathname);
-    std::string filename = filename_set[filename_set.size()-1];
-    std::unique_lock<std::mutex> curr_mutex(disk_block_lock[0]);
-    uint32_t target_inode_id = Find_target_inode(client_request, curr_mutex);
-    fs_inode target_inode; // target inode is the dir for the to be deleted dir/file
-    disk_readblock(target_inode_id, &target_inode);
-    CheckUserValid(target_inode, client_request.username);
-    CheckInodeType(target_inode, 'd');
-    TestPrint("---------- Target Inode Size ---------- ", target_inode.size);
-    for (uint32_t i = 0; i < target_inode.size; i++) {
-        if (Delete_attempt(client_request, i, target_inode_id, target_inode, filename)) {
-            TestPrint("---------- Delete End ---------- ", 0);
-            return;
+    if (strcmp(client_request.pathname, "/") == 0) throw SysError("Cannot delete root node");
+    path_components_t filename_set;
+    Pathname_Parsing(std::string_view(client_request.pathname, client_request.pathname_length), filename_set);
+    std::string_view filename = filename_set.names[filename_set.count - 1];
+    while (true) {
+        block_lock_t target_lock;
+        uint32_t target_inode_id = Find_target_inode(client_request, target_lock);
+        fs_inode target_inode; // target inode is the dir for the to be deleted dir/file
+        Cache_readblock(target_inode_id, &target_inode);
+        CheckUserValid(target_inode, client_request.username);
+        CheckInodeType(target_inode, 'd');
+        TestPrint("---------- Target Inode Size ---------- ", target_inode.size);
+        dir_slot_t delete_slot;
+        if (!Dir_index_lookup(target_inode_id, target_inode, filename, delete_slot)) throw SysError("Not find delete file path!");
+        if (delete_slot.position >= target_inode.size || target_inode.blocks[delete_slot.position] != delete_slot.block) {
+            throw SysError("Directory index is out of date");
         }
+        uint32_t busy_block;
+        if (Delete_attempt(client_request, delete_slot.position, delete_slot.slot, target_inode_id, target_inode, filename, target_lock, busy_block)) break;
+        target_lock.unlock();
+        Block_lock_wait(busy_block);
     }
-
-    throw SysError("Not find delete file path!");
+    TestPrint("---------- Delete End ---------- ", 0);
 }
\ No newline at end of file
@@ -6,15 +6,24 @@
 
 void Filesystem_init();
 
+void Filesystem_shutdown();
+
+void Filesystem_walk();
+
 void ReadBlock_helper(request_t &client_request);
 
 void WriteBlock_helper(request_t &client_request);
 
-void Create_attempt(request_t &client_request, uint32_t free_inode);
+void ReadBlocks_helper(request_t &client_request);
+
+void WriteBlocks_helper(request_t &client_request);
+
+void Create_attempt(request_t &client_request, uint32_t &free_inode);
 
 void Create_helper(request_t &client_request);
 
-bool Delete_attempt(request_t &client_request, uint32_t i, int target_inode_id, fs_inode target_inode, std::string filename);
+bool Delete_attempt(request_t &client_request, uint32_t i, unsigned int j, int target_inode_id, fs_inode &target_inode, std::string_view filename,
+                    const block_lock_t &target_lock, uint32_t &busy_block);
 
 void Delete_helper(request_t &client_request);
 
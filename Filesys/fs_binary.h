@@ -0,0 +1,66 @@
+/*
+ * fs_binary.h
+ *
+ * Binary wire protocol (used by both clients and server).
+ *
+ * A connection speaks the binary protocol if its first byte is FS_BINARY_MAGIC,
+ * otherwise it speaks the text protocol.  Text requests always start with 'F',
+ * so the two cannot be confused.  A binary connection stays open for any number
+ * of requests, and the server answers them in the order they were sent.
+ *
+ * Every request is a fs_binary_header followed by username_length bytes of
+ * username, pathname_length bytes of pathname and payload_length bytes of data.
+ * Every response is a fs_binary_header followed by payload_length bytes of data.
+ * All header fields are in network byte order.
+ *
+ *     opcode      FS_BINARY_READBLOCK, ... (same numbering as the server)
+ *     type        CREATE: 'f' or 'd'; 0 otherwise
+ *     status      response only: FS_BINARY_OK or FS_BINARY_FAILED
+ *     request_id  chosen by the client, copied into the response
+ *     block       first block for READBLOCK(S)/WRITEBLOCK(S)
+ *     count       number of blocks for READBLOCKS/WRITEBLOCKS, 1 otherwise
+ *     payload     WRITEBLOCK(S) requests and successful READBLOCK(S) responses
+ *                 carry count * FS_BLOCKSIZE bytes of data, the others none
+ *
+ * A request that fails gets a FS_BINARY_FAILED response and the connection stays
+ * usable.  A malformed header (bad magic, version, opcode or lengths) closes the
+ * connection, since the server cannot find the start of the next request.
+ */
+
+#ifndef _FS_BINARY_H_
+#define _FS_BINARY_H_
+
+#include <cstdint>
+
+#include "fs_param.h"
+
+static const uint8_t FS_BINARY_MAGIC = 0xFB;
+static const uint8_t FS_BINARY_VERSION = 1;
+
+static const uint8_t FS_BINARY_READBLOCK = 0;
+static const uint8_t FS_BINARY_WRITEBLOCK = 1;
+static const uint8_t FS_BINARY_CREATE = 2;
+static const uint8_t FS_BINARY_DELETE = 3;
+static const uint8_t FS_BINARY_READBLOCKS = 5;
+static const uint8_t FS_BINARY_WRITEBLOCKS = 6;
+
+static const uint8_t FS_BINARY_OK = 0;
+static const uint8_t FS_BINARY_FAILED = 1;
+
+struct fs_binary_header {
+    uint8_t magic;                          // FS_BINARY_MAGIC
+    uint8_t version;                        // FS_BINARY_VERSION
+    uint8_t opcode;
+    uint8_t type;
+    uint8_t status;
+    uint8_t username_length;
+    uint16_t pathname_length;
+    uint32_t request_id;
+    uint32_t block;
+    uint32_t count;
+    uint32_t payload_length;
+};
+
+static_assert(sizeof(fs_binary_header) == 24, "fs_binary_header must have no padding");
+
+#endif /* _FS_BINARY_H_ */
@@ -2,6 +2,24 @@
  * fs_client.h
  *
  * Header file for clients of the file server.
+ *
+ * Sessions.  A text connection normally carries one request and one response.
+ * A client that sends the request "FS_SESSION\0" first gets the response
+ * "FS_SESSION\0" and keeps the connection open for any number of requests:
+ *     - requests may be pipelined without waiting for the responses, and the
+ *       server processes and answers them one at a time, in the order they
+ *       were sent
+ *     - a request that fails gets no response, like on a one-shot connection;
+ *       the server then closes the connection and drops every request
+ *       pipelined behind it, so a client knows that the first missing
+ *       response is the one that failed and must resend the rest
+ *     - the session ends when the client closes the connection, or shuts
+ *       down its sending side and reads the remaining responses until the
+ *       server closes
+ * The server stops reading from a session while too many of its requests
+ * wait (its -q option) or while they hold too much written data, so a client
+ * should keep reading responses while it pipelines.  The binary protocol
+ * (fs_binary.h) is always a session.
  */
 
 #ifndef _FS_CLIENT_H_
@@ -55,9 +73,45 @@ extern int fs_readblock(const char *username, const char *pathname,
 extern int fs_writeblock(const char *username, const char *pathname,
                          unsigned int offset, const void *buf);
 
+/*
+ * Read count contiguous blocks of data from the file specified by pathname,
+ * starting at block offset.  buf must hold count * FS_BLOCKSIZE bytes.
+ * The whole range is read with a single request to the file server.
+ *
+ * fs_readblocks returns 0 on success, -1 on failure.  Possible failures include:
+ *     pathname is invalid
+ *     pathname does not exist, is not a file, or is not owned by username
+ *     count is 0 or above 4096, or any block of the range is out of range
+ *     username is invalid
+ *
+ * fs_readblocks is thread safe.
+ */
+extern int fs_readblocks(const char *username, const char *pathname,
+                         unsigned int offset, unsigned int count, void *buf);
+
+/*
+ * Write count contiguous blocks of data to the file specified by pathname,
+ * starting at block offset.  offset may refer to an existing block in the
+ * file, or to the block immediately after the current end of the file; the
+ * range may extend past the current end of the file.  buf holds
+ * count * FS_BLOCKSIZE bytes.  Either the whole range is written or nothing is.
+ *
+ * fs_writeblocks returns 0 on success, -1 on failure.  Possible failures include:
+ *     pathname is invalid
+ *     pathname does not exist, is not a file, or is not owned by username
+ *     count is 0 or above 4096, or offset is out of range
+ *     the disk or file is out of space
+ *     username is invalid
+ *
+ * fs_writeblocks is thread safe.
+ */
+extern int fs_writeblocks(const char *username, const char *pathname,
+                          unsigned int offset, unsigned int count,
+                          const void *buf);
+
 /*
  * Create a new file or directory "pathname".  Type can be 'f' (file) or 'd'
- * (directory).
+ * (directory).  A file can grow to the size of the disk.
  *
  * fs_create returns 0 on success, -1 on failure.  Possible failures include:
  *     pathname is invalid
@@ -1,14 +1,138 @@
 #include "global.h"
+#include "metrics.h"
 
 const int listen_queue_length = 30;         // a queue length of 30 is sufficient
-const int max_message_length = 30 + FS_MAXPATHNAME + FS_MAXUSERNAME; // max possible message length received
+const int max_number_length = 10;           // digits of the largest 32-bit block number or count
+/*** Longest request header: FS_WRITEBLOCKS <username> <pathname> <block> <count> ***/
+const int max_message_length = sizeof("FS_WRITEBLOCKS") - 1 + FS_MAXUSERNAME + FS_MAXPATHNAME + 2 * max_number_length + 4; // max possible message length received
 const int max_send_message_length = max_message_length + 1 + FS_BLOCKSIZE; // max possible message length send
-bool disk_block[FS_DISKSIZE];               // true if the disk block is free, false otherwise
-std::mutex disk_block_lock[FS_DISKSIZE];    // mutex array for each disk block
-std::mutex free_block_lock;                 // mutex for disk_block status
+uint32_t disk_size = FS_DISKSIZE;           // number of disk blocks, read from the disk device at startup
+std::unique_ptr<std::atomic<uint64_t>[]> free_block_bitmap; // one bit per disk block, set if the block is free
+uint32_t bitmap_words = 0;                  // number of 64-bit words in free_block_bitmap
+unsigned int block_stripe_count = 4096;     // stripes of the block lock table, rounded up to a power of two
+std::unique_ptr<block_stripe_t[]> block_stripes; // reader-writer locks shared by the disk blocks hashed onto them
 const bool test_mode = false;               // set true to print testing output
+const unsigned int cache_capacity = 1024;   // number of disk blocks held by the block cache
+const unsigned int cache_shard_count = 16;  // number of independently locked cache shards
+int stats_report_interval = 0;              // seconds between cache and latency reports, 0 to disable
+unsigned int worker_count = 8;              // number of worker threads serving requests
+unsigned int request_queue_depth = 256;     // max number of framed requests waiting for a worker
+const size_t pipeline_byte_budget = 4 * FS_MAXREQUESTBLOCKS * FS_BLOCKSIZE; // bytes a session may hold in pipelined requests
+bool persistent_bitmap = false;             // keep the free-block bitmap on disk for fast restarts
+bool write_back_cache = false;              // keep written blocks dirty in the cache and flush them in batches
+const int cache_flush_interval = 50;        // milliseconds between background flushes in write-back mode
+unsigned int readahead_max_window = 32;     // max blocks prefetched ahead of a sequential reader, 0 to disable
+const unsigned int readahead_thread_count = 2; // threads loading prefetched blocks
+const unsigned int dentry_cache_capacity = 4096; // number of resolved paths kept by the dentry cache
+const unsigned int dir_index_capacity = 1024;   // number of directories whose name index is kept in memory
+const char *disk_device = nullptr;          // file or block device holding the disk, nullptr to use disk_readblock/disk_writeblock
 
 
+static unsigned int block_stripe_shift = 32;    // 32 - log2(block_stripe_count)
+
+/*
+ *  Allocate the block lock table, called once at startup
+ */
+void Block_lock_init(){
+    unsigned int stripe_bits = 1;
+    while (stripe_bits < 24 && (1u << stripe_bits) < block_stripe_count) stripe_bits++;
+    block_stripe_count = 1u << stripe_bits;
+    block_stripe_shift = 32 - stripe_bits;
+    block_stripes.reset(new block_stripe_t[block_stripe_count]);
+}
+
+/*
+ *  Fibonacci hashing, so that blocks allocated next to each other land on different stripes
+ */
+block_stripe_t &Block_stripe(uint32_t block){
+    return block_stripes[(uint32_t)(block * 2654435769u) >> block_stripe_shift];
+}
+
+/*
+ *  An exclusive holder makes the version of the stripe odd for as long as it holds the lock,
+ *  so an optimistic reader that sees the same even version before and after its reads
+ *  knows no writer touched what the stripe protects in between
+ */
+void block_lock_t::lock(uint32_t block, bool if_exclusive){
+    unlock();
+    stripe = &Block_stripe(block);
+    exclusive = if_exclusive;
+    if (!(exclusive ? stripe->mutex.try_lock() : stripe->mutex.try_lock_shared())) {
+        /*** Only contended acquisitions are timed, the fast path reads no clock ***/
+        metrics_timer_t wait_timer(METRIC_LOCK_WAIT);
+        if (exclusive) stripe->mutex.lock();
+        else stripe->mutex.lock_shared();
+    }
+    if (exclusive) stripe->version.fetch_add(1, std::memory_order_acq_rel);
+}
+
+/*
+ *  Lock block while still holding held, as hand-over-hand locking does.
+ *  Unrelated blocks share stripes, so stripes are only waited for in increasing order, which
+ *  cannot deadlock. A stripe below the held one is only tried, and held already covers a block
+ *  of its own stripe (this lock then stays empty) unless the block needs a stronger mode.
+ *  Returns false if the block could not be locked that way: the caller must release held,
+ *  wait with Block_lock_wait and start over.
+ */
+bool block_lock_t::lock_next(const block_lock_t &held, uint32_t block, bool if_exclusive){
+    unlock();
+    block_stripe_t *next = &Block_stripe(block);
+    if (next == held.stripe) return held.exclusive || !if_exclusive;
+    if (held.stripe == nullptr || next > held.stripe) {
+        lock(block, if_exclusive);
+        return true;
+    }
+    if (!(if_exclusive ? next->mutex.try_lock() : next->mutex.try_lock_shared())) return false;
+    stripe = next;
+    exclusive = if_exclusive;
+    if (exclusive) stripe->version.fetch_add(1, std::memory_order_acq_rel);
+    return true;
+}
+
+void block_lock_t::unlock(){
+    if (stripe == nullptr) return;
+    if (exclusive) {
+        stripe->version.fetch_add(1, std::memory_order_release);
+        stripe->mutex.unlock();
+    }
+    else stripe->mutex.unlock_shared();
+    stripe = nullptr;
+}
+
+void block_lock_t::swap(block_lock_t &other){
+    std::swap(stripe, other.stripe);
+    std::swap(exclusive, other.exclusive);
+}
+
+/*
+ *  Wait until nobody holds the stripe of block, the caller holds no block lock
+ *  Nothing is changed under the lock, so the version stays as it is
+ */
+void Block_lock_wait(uint32_t block){
+    metrics_timer_t wait_timer(METRIC_LOCK_WAIT);
+    block_stripe_t &stripe = Block_stripe(block);
+    stripe.mutex.lock();
+    stripe.mutex.unlock();
+}
+
+/*
+ *  Start an optimistic read of what block protects, without taking its lock
+ *  Returns false if a writer holds the stripe of the block right now
+ */
+bool Block_version_begin(uint32_t block, uint64_t &version){
+    version = Block_stripe(block).version.load(std::memory_order_acquire);
+    return (version & 1) == 0;
+}
+
+/*
+ *  Finish an optimistic read, returns true if no writer locked the stripe since Block_version_begin
+ *  The reads themselves go through the cache locks, the fence keeps the version load after them
+ */
+bool Block_version_validate(uint32_t block, uint64_t version){
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return Block_stripe(block).version.load(std::memory_order_relaxed) == version;
+}
+
 SysError::SysError(std::string error_name){
     error = error_name;
 }
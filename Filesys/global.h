@@ -3,9 +3,11 @@
 
 #include "fs_server.h"
 #include "fs_client.h"
+#include "fs_binary.h"
 #include <iostream>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdio.h>
@@ -14,24 +16,71 @@
 #include <unistd.h>
 #include <cstring>
 #include <thread>
+#include <algorithm>
+#include <shared_mutex>
 #include <queue>
+#include <deque>
 #include <vector>
 #include <cassert>
 #include <sstream>
-#include <regex>
+#include <string_view>
+#include <atomic>
+#include <condition_variable>
+#include <unordered_map>
+#include <list>
+#include <memory>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
 
 #define READ   0
 #define WRITE  1
 #define CREATE 2
 #define DELETE 3
+#define SESSION 4
+#define READBLOCKS  5
+#define WRITEBLOCKS 6
+
+/*
+ * Max blocks moved by one READBLOCKS/WRITEBLOCKS request, it bounds the payload buffer of a request
+ */
+static const unsigned int FS_MAXREQUESTBLOCKS = 4096;
+
+/*
+ *  One stripe of the block lock table. Disk blocks are hashed onto the stripes, so the table
+ *  stays the same size however large the disk is.
+ */
+struct alignas(64) block_stripe_t {
+    std::shared_mutex mutex;
+    std::atomic<uint64_t> version{0};       // odd while the stripe is locked exclusively, see block_lock_t
+};
 
 extern const int listen_queue_length;
 extern const int max_message_length;
 extern const int max_send_message_length;
-extern bool disk_block[FS_DISKSIZE];
-extern std::mutex disk_block_lock[FS_DISKSIZE];
-extern std::mutex free_block_lock;
+extern uint32_t disk_size;
+extern std::unique_ptr<std::atomic<uint64_t>[]> free_block_bitmap;
+extern uint32_t bitmap_words;
+extern unsigned int block_stripe_count;
+extern std::unique_ptr<block_stripe_t[]> block_stripes;
 extern const bool test_mode;
+extern const unsigned int cache_capacity;
+extern const unsigned int cache_shard_count;
+extern int stats_report_interval;
+extern unsigned int worker_count;
+extern unsigned int request_queue_depth;
+extern const size_t pipeline_byte_budget;
+extern bool persistent_bitmap;
+extern bool write_back_cache;
+extern const int cache_flush_interval;
+extern unsigned int readahead_max_window;
+extern const unsigned int readahead_thread_count;
+extern const unsigned int dentry_cache_capacity;
+extern const unsigned int dir_index_capacity;
+extern const char *disk_device;
 
 struct direntry_node_t {
     fs_direntry directory[FS_DIRENTRIES];
@@ -39,13 +88,45 @@ struct direntry_node_t {
 
 struct request_t {
     int request_type;
-    std::string username;
-    std::string pathname;
+    char username[FS_MAXUSERNAME + 1];
+    uint32_t username_length;
+    char pathname[FS_MAXPATHNAME + 1];
+    uint32_t pathname_length;
     uint32_t block;
+    uint32_t count;                         // number of blocks for READBLOCKS/WRITEBLOCKS, 1 otherwise
+    uint32_t request_id;                    // binary protocol only, copied into the response
     char type;
     char data[FS_BLOCKSIZE];
+    std::vector<char> blocks_data;          // count * FS_BLOCKSIZE bytes for READBLOCKS/WRITEBLOCKS
+};
+
+/*
+ *  Holds the lock stripe of one disk block in shared or exclusive mode, and releases it when destroyed
+ */
+struct block_lock_t {
+    block_stripe_t *stripe = nullptr;
+    bool exclusive = false;
+    block_lock_t() = default;
+    block_lock_t(const block_lock_t &) = delete;
+    block_lock_t &operator=(const block_lock_t &) = delete;
+    void lock(uint32_t block, bool if_exclusive);
+    bool lock_next(const block_lock_t &held, uint32_t block, bool if_exclusive);
+    bool held() const { return stripe != nullptr; }
+    void unlock();
+    void swap(block_lock_t &other);
+    ~block_lock_t() { unlock(); }
 };
 
+void Block_lock_init();
+
+block_stripe_t &Block_stripe(uint32_t block);
+
+void Block_lock_wait(uint32_t block);
+
+bool Block_version_begin(uint32_t block, uint64_t &version);
+
+bool Block_version_validate(uint32_t block, uint64_t version);
+
 class SysError {
 private:
     std::string error;
@@ -53,4 +134,63 @@ public:
     SysError(std::string error_name);
 };
 
+/*
+ *  String of at most N characters stored inline.
+ *  It is used as a hash key that can be built from a string_view without touching the heap.
+ */
+template <size_t N>
+struct inline_string_t {
+    uint32_t length = 0;
+    char text[N + 1];
+    inline_string_t() { text[0] = '\0'; }
+    inline_string_t(std::string_view view) {
+        if (view.length() > N) throw SysError("String too long");
+        length = view.length();
+        memcpy(text, view.data(), length);
+        text[length] = '\0';
+    }
+    std::string_view view() const { return std::string_view(text, length); }
+    bool operator==(const inline_string_t &other) const { return view() == other.view(); }
+};
+
+template <size_t N>
+struct inline_string_hash_t {
+    size_t operator()(const inline_string_t<N> &key) const { return std::hash<std::string_view>()(key.view()); }
+};
+
+/*
+ *  FIFO queue stored in a circular buffer.
+ *  It only allocates when it grows past its largest size so far, so a queue that has reached
+ *  its working size pushes and pops without touching the heap.
+ */
+template <typename T>
+struct ring_queue_t {
+    std::vector<T> slots;
+    size_t head = 0;                        // index of the front element
+    size_t count = 0;
+    explicit ring_queue_t(size_t capacity = 0) : slots(capacity) {}
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    T &front() { return slots[head]; }
+    void push_back(T &&value) {
+        if (count == slots.size()) {
+            /*** Unroll into a buffer twice as large, the front moves to index 0 ***/
+            std::vector<T> larger(std::max<size_t>(slots.size() * 2, 4));
+            for (size_t i = 0; i < count; i++) larger[i] = std::move(slots[(head + i) % slots.size()]);
+            slots.swap(larger);
+            head = 0;
+        }
+        slots[(head + count) % slots.size()] = std::move(value);
+        count++;
+    }
+    void pop_front() {
+        slots[head] = T();
+        head = (head + 1) % slots.size();
+        count--;
+    }
+    void clear() {
+        while (!empty()) pop_front();
+    }
+};
+
 #endif /* _struct_H_ */
\ No newline at end of file
@@ -2,155 +2,253 @@
 
 extern const int listen_queue_length;
 extern const int max_message_length;
-extern bool disk_block[FS_DISKSIZE];
-extern std::mutex disk_block_lock[FS_DISKSIZE];
-extern std::mutex free_block_lock;
 extern const bool test_mode;
 
-const std::regex READ_REG("^(FS_READBLOCK [^ \n\t\v\f\r]+ [^ \n\t\v\f\r]+ [0-9]+)$");
-const std::regex WRITE_REG("^(FS_WRITEBLOCK [^ \n\t\v\f\r]+ [^ \n\t\v\f\r]+ [0-9]+)$");
-const std::regex CREATE_REG("^(FS_CREATE [^ \n\t\v\f\r]+ [^ \n\t\v\f\r]+ [fd]+)$");
-const std::regex DELETE_REG("^(FS_DELETE [^ \n\t\v\f\r]+ [^ \n\t\v\f\r]+)$");
-
 /*
- *  Apply hand-over-hand locking
- *  Find the target disk block id of the inode indicated by pathname
- *  For READ/WRITE, we return the last inode
- *  For CREATE/DELETE, we return the second last inode
+ *  Walk from the root down to target_depth with hand-over-hand locking, the inodes from
+ *  exclusive_depth on are locked exclusively, the others shared.
+ *  Returns false if the next lock could not be taken while holding the current one (see
+ *  block_lock_t::lock_next). Nothing is held then, and exclusive_depth is lowered if the
+ *  current inode has to be locked exclusively to cover the next one.
  */
-uint32_t Find_target_inode(request_t &client_request, std::unique_lock<std::mutex> &curr_mutex){
-    std::vector<std::string> filename_set = Pathname_Parsing(client_request.pathname);
+static bool Walk_path(request_t &client_request, const path_components_t &filename_set, size_t target_depth,
+                      size_t &exclusive_depth, block_lock_t &target_lock, uint32_t &target_block){
     uint32_t curr_disk_block = 0;
-    uint32_t next_disk_block = 0;   
-    size_t target_depth = ((client_request.request_type == READ) || (client_request.request_type == WRITE))?filename_set.size():(filename_set.size() - 1);
+    uint32_t next_disk_block = 0;
+    block_lock_t curr_lock;
+    curr_lock.lock(0, exclusive_depth == 0);
     for (size_t i = 0; i < target_depth; i++) {
         fs_inode curr_inode;
-        disk_readblock(curr_disk_block, &curr_inode);
+        Cache_readblock(curr_disk_block, &curr_inode);
         CheckUserValid(curr_inode, client_request.username);
         CheckInodeType(curr_inode, 'd');
 
-        bool if_found = false;
-        for (uint32_t j = 0; j < curr_inode.size; j++) {
-            if (if_found) break;
-            direntry_node_t dire_node;
-            disk_readblock(curr_inode.blocks[j], &dire_node.directory);
-            for (unsigned int k = 0; k < FS_DIRENTRIES; k++) {
-                if (dire_node.directory[k].inode_block != 0 && std::string(dire_node.directory[k].name) == filename_set[i]) {
-                    next_disk_block = dire_node.directory[k].inode_block;
-                    if_found = true;
-                    break;
-                }
-            }
+        dir_slot_t next_slot;
+        if (Dir_index_lookup(curr_disk_block, curr_inode, filename_set.names[i], next_slot)) {
+            next_disk_block = next_slot.inode_block;
         }
         if (next_disk_block == curr_disk_block) throw SysError("no next_disk_block");
 
         /*** Perform hand-over-hand locking ***/
-        std::unique_lock<std::mutex> next_mutex(disk_block_lock[next_disk_block]);
-        curr_mutex.swap(next_mutex);
+        block_lock_t next_lock;
+        bool next_exclusive = i + 1 >= exclusive_depth;
+        if (!next_lock.lock_next(curr_lock, next_disk_block, next_exclusive)) {
+            bool same_stripe = &Block_stripe(next_disk_block) == curr_lock.stripe;
+            curr_lock.unlock();
+            if (same_stripe) exclusive_depth = i;
+            else Block_lock_wait(next_disk_block);
+            return false;
+        }
+        /*** An empty next_lock means curr_lock already covers the next inode, so it is kept ***/
+        if (next_lock.held()) curr_lock.swap(next_lock);
         curr_disk_block = next_disk_block;
     }
-    return curr_disk_block;
+    target_lock.swap(curr_lock);
+    target_block = curr_disk_block;
+    return true;
 }
 
 /*
- *  Find a set of filename or directory name of a given pathname
+ *  Apply hand-over-hand locking
+ *  Find the target disk block id of the inode indicated by pathname
+ *  For READ/WRITE (and READBLOCKS/WRITEBLOCKS), we return the last inode
+ *  For CREATE/DELETE, we return the second last inode
+ *  Ancestors are locked shared on the way down. On return, target_lock holds the lock of the
+ *  returned inode: shared for READ, exclusive for requests that change it.
+ *  A path found in the dentry cache skips the walk, only the target is locked.
  */
-std::vector<std::string> Pathname_Parsing(std::string pathname){
-    if (pathname[0] != '/') throw SysError("Invalid Path");
-    std::vector<std::string> filename_set;
-    pathname += '/';
-    std::string temp_filename = "";
-    for (size_t i = 1; i < pathname.length(); i++) {
-        if (pathname[i] == '/'){
-            if (temp_filename == "" || temp_filename.length() > FS_MAXFILENAME) throw SysError("Invalid Path");
-            filename_set.push_back(temp_filename);
-            temp_filename = "";
-        }
-        else {
-            temp_filename += pathname[i];
+uint32_t Find_target_inode(request_t &client_request, block_lock_t &target_lock){
+    bool if_file_request = (client_request.request_type == READ) || (client_request.request_type == WRITE) ||
+                           (client_request.request_type == READBLOCKS) || (client_request.request_type == WRITEBLOCKS);
+    bool target_exclusive = (client_request.request_type != READ) && (client_request.request_type != READBLOCKS);
+    std::string_view username(client_request.username, client_request.username_length);
+    std::string_view target_path(client_request.pathname, client_request.pathname_length);
+    if (!if_file_request) target_path = target_path.substr(0, target_path.rfind('/'));
+    uint32_t cached_block;
+    if (!target_path.empty() && Dentry_lookup(target_path, username, cached_block)) {
+        block_lock_t cached_lock;
+        cached_lock.lock(cached_block, target_exclusive);
+        uint32_t locked_block;
+        if (Dentry_lookup(target_path, username, locked_block) && locked_block == cached_block) {
+            target_lock.swap(cached_lock);
+            return cached_block;
         }
     }
-    return filename_set;
+
+    path_components_t filename_set;
+    Pathname_Parsing(std::string_view(client_request.pathname, client_request.pathname_length), filename_set);
+    size_t target_depth = if_file_request?filename_set.count:(filename_set.count - 1);
+    size_t exclusive_depth = target_exclusive ? target_depth : target_depth + 1;
+    uint32_t target_block = 0;
+    while (!Walk_path(client_request, filename_set, target_depth, exclusive_depth, target_lock, target_block));
+    if (target_depth > 0) Dentry_insert(target_path, username, target_block);
+    return target_block;
+}
+
+/*
+ *  Find a set of filename or directory name of a given pathname
+ *  The components are views into pathname, which must outlive them
+ */
+void Pathname_Parsing(std::string_view pathname, path_components_t &components){
+    if (pathname.empty() || pathname[0] != '/') throw SysError("Invalid Path");
+    components.count = 0;
+    size_t begin = 1;
+    while (true) {
+        size_t end = pathname.find('/', begin);
+        if (end == std::string_view::npos) end = pathname.length();
+        std::string_view filename = pathname.substr(begin, end - begin);
+        if (filename.empty() || filename.length() > FS_MAXFILENAME) throw SysError("Invalid Path");
+        components.names[components.count++] = filename;
+        if (end == pathname.length()) return;
+        begin = end + 1;
+    }
 }
 
 /*
- *  Find the request type of a given client message
+ *  Characters that may not appear inside a message field
  */
-int Find_Request_Type(std::string message){
-    if (std::regex_match(message, READ_REG))   return READ;
-    if (std::regex_match(message, WRITE_REG))  return WRITE;
-    if (std::regex_match(message, CREATE_REG)) return CREATE;
-    if (std::regex_match(message, DELETE_REG)) return DELETE;
-    throw SysError("Unkown Message Type");
+static bool Is_space(char c){
+    return c == ' ' || c == '\n' || c == '\t' || c == '\v' || c == '\f' || c == '\r';
 }
 
 /*
- *  Convert a string block to an int block
- *  Check if there is leading zeros in the string block
+ *  Take the next field of the message starting at pos, fields are separated by exactly one space
+ *  Throw if the field is empty or contains a whitespace character
  */
-uint32_t String_to_Int(std::string block){
+static std::string_view Next_field(std::string_view message, size_t &pos){
+    if (pos > message.length()) throw SysError("Missing field in message");
+    size_t field_end = message.find(' ', pos);
+    if (field_end == std::string_view::npos) field_end = message.length();
+    std::string_view field = message.substr(pos, field_end - pos);
+    if (field.empty()) throw SysError("Empty field in message");
+    for (char c : field) {
+        if (Is_space(c)) throw SysError("Whitespace in message field");
+    }
+    pos = field_end + 1;
+    return field;
+}
+
+/*
+ *  Convert a block field to an int block
+ *  Check if there is leading zeros in the block field, or if it does not fit in 32 bits
+ */
+uint32_t String_to_Int(std::string_view block){
     if (block.length() == 0) throw SysError("Empty block number");
     if (block[0] == '0' && block.length() > 1) throw SysError("Leading Zeros in Block");
-    for (size_t i = 0 ; i < block.length(); i++){
-        if ((block[i] < '0') || (block[i] > '9')) throw SysError("Invalid block number");
+    uint64_t value = 0;
+    for (char c : block) {
+        if ((c < '0') || (c > '9')) throw SysError("Invalid block number");
+        value = value * 10 + (c - '0');
+        if (value > UINT32_MAX) throw SysError("Block number overflow");
     }
-    return atoi(block.c_str());
+    return (uint32_t)value;
 }
 
 /* 
- *  This function process the string message and parse it into a request_t struct that contains all the useful information
+ *  This function process the message in a single pass and parse it into a request_t struct that contains all the useful information
+ *  Grammar (fields separated by exactly one space, no other whitespace allowed):
+ *      FS_READBLOCK <username> <pathname> <block>
+ *      FS_WRITEBLOCK <username> <pathname> <block>
+ *      FS_READBLOCKS <username> <pathname> <block> <count>
+ *      FS_WRITEBLOCKS <username> <pathname> <block> <count>
+ *      FS_CREATE <username> <pathname> <f|d>
+ *      FS_DELETE <username> <pathname>
+ *      FS_SESSION
  */
-request_t Message_Parsing(std::string message){
+request_t Message_Parsing(std::string_view message){
     request_t request;
     request.block = 0;
-    std::istringstream m_stream(message);
-    std::string protocal_type;
-    int message_type = Find_Request_Type(message);
-    std::string block_string;
-    std::string type_string;
-    request.request_type = message_type;
-    if ((message_type == READ) || (message_type == WRITE)){
-        m_stream >> protocal_type >> request.username >> request.pathname >> block_string;
-        request.block = String_to_Int(block_string);
-    }
-    else if (message_type == CREATE){
-        m_stream >> protocal_type >> request.username >> request.pathname >> type_string;
-        if (type_string == "d")      request.type = 'd';
-        else if (type_string == "f") request.type = 'f';
-        else throw SysError("Invalid type");
-    }
-    else if (message_type == DELETE){
-        m_stream >> protocal_type >> request.username >> request.pathname;
-    }
-    else throw SysError("Unknow Request Type");
-    Check_Valid_Message(message, request);
-    Check_Valid_Request(request);
-    return request;
-}
-
-uint32_t Find_free_disk_block(){
-    std::unique_lock<std::mutex> m(free_block_lock); 
-    for (uint32_t i = 0; i < FS_DISKSIZE; i++) {
-        if (disk_block[i]){
-            disk_block[i] = false;
-            return i;
+    request.count = 1;
+    request.request_id = 0;
+    request.username[0] = request.pathname[0] = '\0';
+    request.username_length = request.pathname_length = 0;
+    size_t pos = 0;
+    std::string_view protocal_type = Next_field(message, pos);
+    size_t field_count;
+    if (protocal_type == "FS_READBLOCK")       { request.request_type = READ;    field_count = 4; }
+    else if (protocal_type == "FS_WRITEBLOCK") { request.request_type = WRITE;   field_count = 4; }
+    else if (protocal_type == "FS_CREATE")     { request.request_type = CREATE;  field_count = 4; }
+    else if (protocal_type == "FS_DELETE")     { request.request_type = DELETE;  field_count = 3; }
+    else if (protocal_type == "FS_SESSION")    { request.request_type = SESSION; field_count = 1; }
+    else if (protocal_type == "FS_READBLOCKS")  { request.request_type = READBLOCKS;  field_count = 5; }
+    else if (protocal_type == "FS_WRITEBLOCKS") { request.request_type = WRITEBLOCKS; field_count = 5; }
+    else throw SysError("Unkown Message Type");
+    if (field_count > 1) {
+        std::string_view username = Next_field(message, pos);
+        std::string_view pathname = Next_field(message, pos);
+        if (username.length() > FS_MAXUSERNAME) throw SysError("Username Length Overflow");
+        if (pathname.length() > FS_MAXPATHNAME) throw SysError("Pathname Length Overflow");
+        memcpy(request.username, username.data(), username.length());
+        request.username[username.length()] = '\0';
+        request.username_length = username.length();
+        memcpy(request.pathname, pathname.data(), pathname.length());
+        request.pathname[pathname.length()] = '\0';
+        request.pathname_length = pathname.length();
+    }
+    if (field_count > 3) {
+        std::string_view type_or_block = Next_field(message, pos);
+        if (request.request_type == CREATE) {
+            if (type_or_block == "d")      request.type = 'd';
+            else if (type_or_block == "f") request.type = 'f';
+            else throw SysError("Invalid type");
+        }
+        else {
+            request.block = String_to_Int(type_or_block);
         }
     }
-    throw SysError("No free disk blocks");
+    if (field_count > 4) {
+        request.count = String_to_Int(Next_field(message, pos));
+    }
+    if (pos <= message.length()) throw SysError("Too many fields in message");
+    if (request.request_type != SESSION) Check_Valid_Request(request);
+    return request;
 }
 
+static_assert(FS_BINARY_READBLOCK == READ && FS_BINARY_WRITEBLOCK == WRITE && FS_BINARY_CREATE == CREATE &&
+              FS_BINARY_DELETE == DELETE && FS_BINARY_READBLOCKS == READBLOCKS && FS_BINARY_WRITEBLOCKS == WRITEBLOCKS,
+              "binary opcodes must match the request types");
+
 /* 
- *  This function set the diskblock status
+ *  This function reads the header of a binary request (see fs_binary.h), already converted to host
+ *  byte order, and the username and pathname that follow it.
+ *  Only the framing is checked here, a malformed header cannot be skipped and closes the connection.
+ *  The request itself is checked with Check_Valid_Request when it is served, so that it can fail with a status.
  */
-void Set_disk_block_status(uint32_t index, bool if_free){
-    std::unique_lock<std::mutex> m(free_block_lock); 
-    disk_block[index] = if_free;
+request_t Binary_Parsing(const fs_binary_header &header, const char *names){
+    if (header.magic != FS_BINARY_MAGIC || header.version != FS_BINARY_VERSION) throw SysError("Unknown binary protocol version");
+    if (header.username_length > FS_MAXUSERNAME) throw SysError("Username Length Overflow");
+    if (header.pathname_length > FS_MAXPATHNAME) throw SysError("Pathname Length Overflow");
+    request_t request;
+    request.request_type = header.opcode;
+    request.request_id = header.request_id;
+    request.block = header.block;
+    request.count = header.count;
+    request.type = header.type;
+    uint64_t payload_length = 0;
+    switch (header.opcode) {
+        case READ: case CREATE: case DELETE: case READBLOCKS: break;
+        case WRITE:       payload_length = FS_BLOCKSIZE; break;
+        case WRITEBLOCKS:
+            if (header.count > FS_MAXREQUESTBLOCKS) throw SysError("Block Count Overflow");
+            payload_length = (uint64_t)header.count * FS_BLOCKSIZE;
+            break;
+        default: throw SysError("Unkown Message Type");
+    }
+    if (header.payload_length != payload_length) throw SysError("Invalid payload length");
+    if (header.opcode != READBLOCKS && header.opcode != WRITEBLOCKS) request.count = 1;
+    memcpy(request.username, names, header.username_length);
+    request.username[header.username_length] = '\0';
+    request.username_length = header.username_length;
+    memcpy(request.pathname, names + header.username_length, header.pathname_length);
+    request.pathname[header.pathname_length] = '\0';
+    request.pathname_length = header.pathname_length;
+    return request;
 }
 
 /* 
  *  This function is a helper function to print the output for testing if needed
  */
-void TestPrint(std::string test_output, size_t index){
+void TestPrint(const char *test_output, size_t index){
     if (test_mode){
         cout_lock.lock();
         std::cout << test_output << index << std::endl;
@@ -159,47 +257,33 @@ void TestPrint(std::string test_output, size_t index){
 }
 
 /* 
- *  This function checks whether the received message is valid
+ *  This function checks whether the user request is valid
  */
-void Check_Valid_Message(std::string message, request_t client_request){
-    std::string message_str = "";
-    std::string block = "";
-    if (client_request.request_type == READ){
-        block = std::to_string(client_request.block);
-        message_str = "FS_READBLOCK " + client_request.username + " " + client_request.pathname + " " + block;
+void Check_Valid_Request(const request_t &request){
+    /*** The limit of the file itself (Inode_max_blocks) is checked once its inode is read ***/
+    if (request.block >= disk_size) throw SysError("Block Overflow");
+    if ((request.count == 0) || (request.count > FS_MAXREQUESTBLOCKS) || (request.count > disk_size - request.block)) throw SysError("Block Count Overflow");
+    if ((request.username_length > FS_MAXUSERNAME) || (request.username_length == 0)) throw SysError("Username Length Overflow");
+    if ((request.pathname_length > FS_MAXPATHNAME) || (request.pathname_length == 0)) throw SysError("Pathname Length Overflow");
+    if ((request.pathname[0] != '/') || (request.pathname[request.pathname_length-1] == '/')) throw SysError("Pathname Not Valid");
+    /*** The text parser already guarantees these, binary requests carry raw bytes ***/
+    for (uint32_t i = 0; i < request.username_length; i++) {
+        if (request.username[i] == '\0' || Is_space(request.username[i])) throw SysError("Username Not Valid");
     }
-    else if (client_request.request_type == WRITE){
-        block = std::to_string(client_request.block);
-        message_str = "FS_WRITEBLOCK " + client_request.username + " " + client_request.pathname + " " + block;
+    for (uint32_t i = 0; i < request.pathname_length; i++) {
+        if (request.pathname[i] == '\0' || Is_space(request.pathname[i])) throw SysError("Pathname Not Valid");
     }
-    else if (client_request.request_type == CREATE){
-        message_str = "FS_CREATE " + client_request.username + " " + client_request.pathname + " " + client_request.type;
-    }
-    else if (client_request.request_type == DELETE){
-        message_str = "FS_DELETE " + client_request.username + " " + client_request.pathname;
-    }
-    if (message_str != message) throw SysError("Invalid Input Request Message!");
-
-}
-
-/* 
- *  This function checks whether the user request is valid
- */
-void Check_Valid_Request(request_t request){
-    if (request.block >= FS_MAXFILEBLOCKS) throw SysError("Block Overflow");
-    if ((request.username.length() > FS_MAXUSERNAME) || (request.username.length() == 0)) throw SysError("Username Length Overflow");
-    if ((request.pathname.length() > FS_MAXPATHNAME) || (request.username.length() == 0)) throw SysError("Pathname Length Overflow");
-    if ((request.pathname[0] != '/') || (request.pathname[request.pathname.length()-1] == '/')) throw SysError("Pathname Not Valid");
+    if (request.request_type == CREATE && request.type != 'f' && request.type != 'd') throw SysError("Invalid type");
 }
 
 /* 
  *  This function checks whether the user can access the path
  */
-void CheckUserValid(fs_inode target_inode, std::string username){
-    if (std::string(target_inode.owner) == ""){
+void CheckUserValid(const fs_inode &target_inode, const char *username){
+    if (target_inode.owner[0] == '\0'){
         return;
     }
-    if (std::string(target_inode.owner) != username){
+    if (strncmp(target_inode.owner, username, FS_MAXUSERNAME + 1) != 0){
         throw SysError("User has no permission");
     }
 }
@@ -207,7 +291,7 @@ void CheckUserValid(fs_inode target_inode, std::string username){
 /* 
  *  This function checks whether the block is overflow
  */
-void CheckBlockOverflow(fs_inode target_inode, uint32_t block){
+void CheckBlockOverflow(const fs_inode &target_inode, uint32_t block){
     if (block >= target_inode.size){
         throw SysError("Block index overflow");
     }
@@ -216,8 +300,17 @@ void CheckBlockOverflow(fs_inode target_inode, uint32_t block){
 /* 
  *  This function checks whether the inode is the correct type
  */
-void CheckInodeType(fs_inode target_inode, char type){
+void CheckInodeType(const fs_inode &target_inode, char type){
     if (target_inode.type != type){
         throw SysError("Invalid inode type");
     }
-}
\ No newline at end of file
+}
+
+/* 
+ *  This function checks whether the inode is a file, plain or extent based
+ */
+void CheckFileType(const fs_inode &target_inode){
+    if (!Is_file_type(target_inode.type)){
+        throw SysError("Invalid inode type");
+    }
+}
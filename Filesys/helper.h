@@ -2,32 +2,44 @@
 #define _HELPER_H_
 
 #include "global.h"
+#include "cache.h"
+#include "block_io.h"
+#include "dir_index.h"
+#include "dentry.h"
+#include "metrics.h"
+#include "alloc.h"
+#include "inode_map.h"
+#include "readahead.h"
 
-uint32_t Find_target_inode(request_t &client_request, std::unique_lock<std::mutex> &curr_mutex);
+/*
+ *  Components of a pathname, as views into the pathname of the request
+ */
+struct path_components_t {
+    std::string_view names[FS_MAXPATHNAME / 2 + 1];
+    size_t count = 0;
+};
 
-std::vector<std::string> Pathname_Parsing(std::string pathname);
+uint32_t Find_target_inode(request_t &client_request, block_lock_t &target_lock);
 
-int Find_Request_Type(std::string message);
+void Pathname_Parsing(std::string_view pathname, path_components_t &components);
 
-uint32_t String_to_Int(std::string block);
+uint32_t String_to_Int(std::string_view block);
 
-request_t Message_Parsing(std::string message);
+request_t Message_Parsing(std::string_view message);
 
-uint32_t Find_free_disk_block();
+request_t Binary_Parsing(const fs_binary_header &header, const char *names);
 
-void Set_disk_block_status(uint32_t index, bool if_free);
+void TestPrint(const char *test_output, size_t index);
 
-void TestPrint(std::string test_output, size_t index);
+void Check_Valid_Request(const request_t &request);
 
-void Check_Valid_Message(std::string message, request_t client_request);
+void CheckUserValid(const fs_inode &target_inode, const char *username);
 
-void Check_Valid_Request(request_t request);
+void CheckBlockOverflow(const fs_inode &target_inode, uint32_t block);
 
-void CheckUserValid(fs_inode target_inode, std::string username);
+void CheckInodeType(const fs_inode &target_inode, char type);
 
-void CheckBlockOverflow(fs_inode target_inode, uint32_t block);
-
-void CheckInodeType(fs_inode target_inode, char type);
+void CheckFileType(const fs_inode &target_inode);
 
 
 #endif /* _HELPER_H_ */
\ No newline at end of file
@@ -0,0 +1,289 @@
+#include "inode_map.h"
+#include "helper.h"
+
+/*
+ *  Files are either plain ('f', one pointer per block, or 'i' while the data is inline) or extent files ('e')
+ */
+bool Is_file_type(char type){
+    return type == 'f' || type == 'e' || type == 'i';
+}
+
+/*
+ *  Plain files turn into extent files when they grow past their block pointers, so every file
+ *  can grow to the size of the disk
+ */
+uint32_t Inode_max_blocks(const fs_inode &inode){
+    return (inode.type == 'e' || inode.type == 'f') ? disk_size : FS_MAXFILEBLOCKS;
+}
+
+/*
+ *  Read the inode stored in inode_id, and for an extent file also its indirect extent block
+ */
+void Inode_map_load(inode_map_t &map, uint32_t inode_id){
+    map.inode_id = inode_id;
+    Cache_readblock(inode_id, &map.inode);
+    map.extent_count = 0;
+    if (map.inode.type != 'e') return;
+    fs_extent_inode extent_inode;
+    memcpy(&extent_inode, &map.inode, sizeof(extent_inode));
+    if (extent_inode.extent_count > FS_MAXEXTENTS || extent_inode.indirect_block >= disk_size) throw SysError("Corrupted extent inode");
+    uint32_t inline_count = std::min(extent_inode.extent_count, FS_INLINE_EXTENTS);
+    memcpy(map.extents, extent_inode.extents, inline_count * sizeof(fs_extent));
+    if (extent_inode.extent_count > FS_INLINE_EXTENTS) {
+        Cache_readblock(extent_inode.indirect_block, map.extents + FS_INLINE_EXTENTS);
+    }
+    map.extent_count = extent_inode.extent_count;
+}
+
+/*
+ *  Disk block holding file block "block", which must be below the size of the file
+ */
+uint32_t Inode_map_block(const inode_map_t &map, uint32_t block){
+    if (map.inode.type == 'i') throw SysError("Inline file has no blocks");
+    uint32_t disk_block = disk_size;
+    if (map.inode.type != 'e') {
+        if (block < FS_MAXFILEBLOCKS) disk_block = map.inode.blocks[block];
+    }
+    else {
+        for (uint32_t i = 0; i < map.extent_count; i++) {
+            if (block < map.extents[i].length) {
+                disk_block = map.extents[i].start + block;
+                break;
+            }
+            block -= map.extents[i].length;
+        }
+    }
+    /*** An optimistic reader may map a block that stopped being this inode, never go past the disk ***/
+    if (disk_block >= disk_size) throw SysError("Block index overflow");
+    return disk_block;
+}
+
+/*
+ *  Disk blocks holding file blocks first .. first + count - 1
+ */
+void Inode_map_range(const inode_map_t &map, uint32_t first, uint32_t count, uint32_t *blocks){
+    if (map.inode.type == 'i') throw SysError("Inline file has no blocks");
+    if (map.inode.type != 'e') {
+        if (first >= FS_MAXFILEBLOCKS || count > FS_MAXFILEBLOCKS - first) throw SysError("Block index overflow");
+        memcpy(blocks, map.inode.blocks + first, count * sizeof(uint32_t));
+        for (uint32_t i = 0; i < count; i++) {
+            if (blocks[i] >= disk_size) throw SysError("Block index overflow");
+        }
+        return;
+    }
+    uint32_t done = 0;
+    for (uint32_t k = 0; k < map.extent_count; k++) {
+        const fs_extent &extent = map.extents[k];
+        if (done == count) break;
+        if (first >= extent.length) {
+            first -= extent.length;
+            continue;
+        }
+        for (uint32_t i = first; i < extent.length && done < count; i++) {
+            if (extent.start + i >= disk_size) throw SysError("Block index overflow");
+            blocks[done++] = extent.start + i;
+        }
+        first = 0;
+    }
+    if (done < count) throw SysError("Block index overflow");
+}
+
+/*
+ *  Turn a plain file into an extent file in memory, its blocks stay where they are
+ *  and contiguous ones become one extent
+ */
+static void Inode_map_to_extents(inode_map_t &map){
+    map.extent_count = 0;
+    for (uint32_t i = 0; i < map.inode.size; i++) {
+        uint32_t block = map.inode.blocks[i];
+        fs_extent *last = (map.extent_count > 0) ? &map.extents[map.extent_count - 1] : nullptr;
+        if (last != nullptr && block == last->start + last->length) last->length++;
+        else {
+            if (map.extent_count == FS_MAXEXTENTS) throw SysError("File extents are maximal");
+            map.extents[map.extent_count++] = {block, 1};
+        }
+    }
+    fs_extent_inode extent_inode;
+    memset(&extent_inode, 0, sizeof(extent_inode));
+    extent_inode.type = 'e';
+    memcpy(extent_inode.owner, map.inode.owner, sizeof(extent_inode.owner));
+    extent_inode.size = map.inode.size;
+    memcpy(&map.inode, &extent_inode, sizeof(extent_inode));
+}
+
+/*
+ *  Grow the file to new_size blocks, only in memory until Inode_map_store.
+ *  An extent file asks for a run that continues its last extent, so a file written sequentially
+ *  stays in few contiguous extents. A plain file that grows past FS_MAXFILEBLOCKS becomes an
+ *  extent file first. If anything fails, every block claimed here is released and the map is unchanged.
+ */
+void Inode_map_extend(inode_map_t &map, uint32_t new_size){
+    if (new_size > Inode_max_blocks(map.inode)) throw SysError("File blocks are maximal");
+    uint32_t old_size = map.inode.size;
+    if (new_size <= old_size) return;
+    if (map.inode.type == 'f' && new_size > FS_MAXFILEBLOCKS) {
+        fs_inode plain_inode = map.inode;
+        try {
+            Inode_map_to_extents(map);
+            Inode_map_extend(map, new_size);
+        }
+        catch (SysError &) {
+            map.inode = plain_inode;
+            map.extent_count = 0;
+            throw;
+        }
+        return;
+    }
+    if (map.inode.type != 'e') {
+        /*** New blocks go right after the last one, or after the inode ***/
+        uint32_t goal = (old_size > 0) ? map.inode.blocks[old_size - 1] + 1 : map.inode_id + 1;
+        Find_free_disk_blocks(goal, new_size - old_size, map.inode.blocks + old_size);
+        map.inode.size = new_size;
+        return;
+    }
+    fs_extent_inode extent_inode;
+    memcpy(&extent_inode, &map.inode, sizeof(extent_inode));
+    uint32_t old_count = map.extent_count;
+    uint32_t old_last_length = (old_count > 0) ? map.extents[old_count - 1].length : 0;
+    try {
+        uint32_t needed = new_size - old_size;
+        while (needed > 0) {
+            /*** The first extent starts right after the inode block ***/
+            fs_extent *last = (map.extent_count > 0) ? &map.extents[map.extent_count - 1] : nullptr;
+            uint32_t goal = (last == nullptr) ? map.inode_id + 1 : last->start + last->length;
+            uint32_t length;
+            uint32_t start = Find_free_disk_run(goal, needed, length);
+            if (last != nullptr && start == goal) last->length += length;
+            else {
+                if (map.extent_count == FS_MAXEXTENTS) {
+                    for (uint32_t i = 0; i < length; i++) Set_disk_block_status(start + i, true);
+                    throw SysError("File extents are maximal");
+                }
+                map.extents[map.extent_count++] = {start, length};
+            }
+            needed -= length;
+        }
+        if (map.extent_count > FS_INLINE_EXTENTS && extent_inode.indirect_block == 0) {
+            extent_inode.indirect_block = Find_free_disk_block(map.inode_id);
+        }
+    }
+    catch (SysError &) {
+        /*** Release what this call added: the new extents and the growth of the old last one ***/
+        for (uint32_t k = old_count; k < map.extent_count; k++) {
+            for (uint32_t i = 0; i < map.extents[k].length; i++) Set_disk_block_status(map.extents[k].start + i, true);
+        }
+        if (old_count > 0) {
+            fs_extent &last = map.extents[old_count - 1];
+            for (uint32_t i = old_last_length; i < last.length; i++) Set_disk_block_status(last.start + i, true);
+            last.length = old_last_length;
+        }
+        map.extent_count = old_count;
+        throw;
+    }
+    extent_inode.size = new_size;
+    memcpy(&map.inode, &extent_inode, sizeof(extent_inode));
+}
+
+/*
+ *  Write the inode back, for an extent file the indirect extent block goes first
+ */
+void Inode_map_store(const inode_map_t &map){
+    if (map.inode.type != 'e') {
+        Cache_writeblock(map.inode_id, &map.inode, BLOCK_INODE);
+        return;
+    }
+    fs_extent_inode extent_inode;
+    memcpy(&extent_inode, &map.inode, sizeof(extent_inode));
+    extent_inode.extent_count = map.extent_count;
+    uint32_t inline_count = std::min(extent_inode.extent_count, FS_INLINE_EXTENTS);
+    memcpy(extent_inode.extents, map.extents, inline_count * sizeof(fs_extent));
+    if (extent_inode.extent_count > FS_INLINE_EXTENTS) {
+        fs_extent indirect[FS_INDIRECT_EXTENTS];
+        memset(indirect, 0, sizeof(indirect));
+        memcpy(indirect, map.extents + FS_INLINE_EXTENTS, (extent_inode.extent_count - FS_INLINE_EXTENTS) * sizeof(fs_extent));
+        Cache_writeblock(extent_inode.indirect_block, indirect, BLOCK_DATA);
+    }
+    Cache_writeblock(map.inode_id, &extent_inode, BLOCK_INODE);
+}
+
+/*
+ *  Mark every block the file uses (data and indirect extent block, not the inode) used, or free them
+ *  with Free_disk_block when the file is deleted
+ */
+void Inode_map_set_status(const inode_map_t &map, bool if_free){
+    auto set_status = [if_free](uint32_t block){
+        if (if_free) Free_disk_block(block);
+        else Set_disk_block_status(block, false);
+    };
+    if (map.inode.type == 'i') return;
+    if (map.inode.type != 'e') {
+        for (uint32_t i = 0; i < map.inode.size; i++) set_status(map.inode.blocks[i]);
+        return;
+    }
+    for (uint32_t k = 0; k < map.extent_count; k++) {
+        for (uint32_t i = 0; i < map.extents[k].length; i++) set_status(map.extents[k].start + i);
+    }
+    fs_extent_inode extent_inode;
+    memcpy(&extent_inode, &map.inode, sizeof(extent_inode));
+    if (extent_inode.indirect_block != 0) set_status(extent_inode.indirect_block);
+}
+
+bool Inode_map_inline(const inode_map_t &map){
+    return map.inode.type == 'i';
+}
+
+/*
+ *  Block 0 of an inline file
+ */
+void Inode_map_read_inline(const inode_map_t &map, void *buf){
+    fs_inline_inode inline_inode;
+    memcpy(&inline_inode, &map.inode, sizeof(inline_inode));
+    memcpy(buf, inline_inode.data, FS_INLINE_DATA);
+    memset((char *)buf + FS_INLINE_DATA, 0, FS_BLOCKSIZE - FS_INLINE_DATA);
+}
+
+/*
+ *  Try to keep a write of count blocks from file block "block" in the inode, only in memory
+ *  until Inode_map_store. That works for a plain file that is empty or inline, when the write
+ *  is block 0 alone and the part of it that does not fit in the inode is zero.
+ *  Otherwise an inline file that is written is turned back into a plain file right away: its data moves to a
+ *  new block next to the inode and the inode is stored, so the caller goes on as for any plain file.
+ *  Returns true if the write was kept in the inode.
+ */
+bool Inode_map_write_inline(inode_map_t &map, uint32_t block, uint32_t count, const char *data){
+    bool if_inline = (map.inode.type == 'i');
+    if ((if_inline || (map.inode.type == 'f' && map.inode.size == 0)) && block == 0 && count == 1) {
+        bool tail_zero = true;
+        for (unsigned int i = FS_INLINE_DATA; i < FS_BLOCKSIZE && tail_zero; i++) tail_zero = (data[i] == 0);
+        if (tail_zero) {
+            fs_inline_inode inline_inode;
+            memcpy(&inline_inode, &map.inode, sizeof(inline_inode));
+            inline_inode.type = 'i';
+            inline_inode.size = 1;
+            memcpy(inline_inode.data, data, FS_INLINE_DATA);
+            memcpy(&map.inode, &inline_inode, sizeof(inline_inode));
+            return true;
+        }
+    }
+    /*** A write past the end fails anyway, the file stays inline ***/
+    if (!if_inline || block > map.inode.size) return false;
+    char old_data[FS_BLOCKSIZE];
+    Inode_map_read_inline(map, old_data);
+    uint32_t data_block = Find_free_disk_block(map.inode_id + 1);
+    try {
+        Cache_writeblock(data_block, old_data, BLOCK_DATA);
+    }
+    catch (SysError &) {
+        Set_disk_block_status(data_block, true);
+        throw;
+    }
+    fs_inode plain_inode;
+    memset(&plain_inode, 0, sizeof(plain_inode));
+    plain_inode.type = 'f';
+    memcpy(plain_inode.owner, map.inode.owner, sizeof(plain_inode.owner));
+    plain_inode.size = 1;
+    plain_inode.blocks[0] = data_block;
+    map.inode = plain_inode;
+    Inode_map_store(map);
+    return false;
+}
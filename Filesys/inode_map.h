@@ -0,0 +1,89 @@
+#ifndef _INODE_MAP_H_
+#define _INODE_MAP_H_
+
+#include "global.h"
+#include <cstddef>
+
+/*
+ *  Extent file inode (type 'e').
+ *  It shares the type, owner and size fields with fs_inode, but maps its blocks with runs of
+ *  contiguous disk blocks instead of one pointer per block. Extents that do not fit in the
+ *  inode are kept in one indirect extent block.
+ *  A plain file becomes an extent file when it grows past FS_MAXFILEBLOCKS blocks, clients still
+ *  see a plain file.
+ */
+struct fs_extent {
+    uint32_t start;                        // first disk block of the run
+    uint32_t length;                       // number of disk blocks in the run
+};
+
+static const unsigned int FS_INLINE_EXTENTS = (FS_BLOCKSIZE - offsetof(fs_inode, blocks) - 2 * sizeof(uint32_t)) / sizeof(fs_extent);
+static const unsigned int FS_INDIRECT_EXTENTS = FS_BLOCKSIZE / sizeof(fs_extent);
+static const unsigned int FS_MAXEXTENTS = FS_INLINE_EXTENTS + FS_INDIRECT_EXTENTS;
+
+struct fs_extent_inode {
+    char type;                             // 'e'
+    char owner[FS_MAXUSERNAME + 1];        // owner of this file
+    uint32_t size;                         // size of this file in blocks
+    uint32_t extent_count;                 // number of extents in use, inline ones first
+    uint32_t indirect_block;               // disk block holding the extents past the inline ones, 0 if none
+    fs_extent extents[FS_INLINE_EXTENTS];
+};
+
+static_assert(sizeof(fs_extent_inode) <= FS_BLOCKSIZE, "extent inode must fit in one block");
+static_assert(offsetof(fs_extent_inode, size) == offsetof(fs_inode, size), "extent inode must share the fs_inode header");
+
+/*
+ *  Inline file inode (type 'i').
+ *  A plain file of one block whose last FS_BLOCKSIZE - FS_INLINE_DATA bytes are zero keeps that
+ *  block in the inode, where the block pointers would be, so reading or writing it costs one
+ *  block instead of two. Clients still see a plain file, the tail reads back as zeros.
+ *  A write that does not fit turns the file back into a plain file first.
+ */
+static const unsigned int FS_INLINE_DATA = FS_BLOCKSIZE - offsetof(fs_inode, blocks);
+
+struct fs_inline_inode {
+    char type;                             // 'i'
+    char owner[FS_MAXUSERNAME + 1];        // owner of this file
+    uint32_t size;                         // size of this file in blocks, always 1
+    char data[FS_INLINE_DATA];             // the first FS_INLINE_DATA bytes of block 0
+};
+
+static_assert(sizeof(fs_inline_inode) == FS_BLOCKSIZE, "inline inode must fill one block");
+static_assert(offsetof(fs_inline_inode, size) == offsetof(fs_inode, size), "inline inode must share the fs_inode header");
+
+/*
+ *  Block mapping of a file inode, loaded once per request.
+ *  inode always holds the inode block as on disk; for an extent file, extents holds every extent.
+ *  The extents are stored inline, so loading a map never allocates.
+ */
+struct inode_map_t {
+    uint32_t inode_id;
+    fs_inode inode;
+    uint32_t extent_count;
+    fs_extent extents[FS_MAXEXTENTS];
+};
+
+bool Is_file_type(char type);
+
+uint32_t Inode_max_blocks(const fs_inode &inode);
+
+void Inode_map_load(inode_map_t &map, uint32_t inode_id);
+
+uint32_t Inode_map_block(const inode_map_t &map, uint32_t block);
+
+void Inode_map_range(const inode_map_t &map, uint32_t first, uint32_t count, uint32_t *blocks);
+
+void Inode_map_extend(inode_map_t &map, uint32_t new_size);
+
+void Inode_map_store(const inode_map_t &map);
+
+void Inode_map_set_status(const inode_map_t &map, bool if_free);
+
+bool Inode_map_inline(const inode_map_t &map);
+
+void Inode_map_read_inline(const inode_map_t &map, void *buf);
+
+bool Inode_map_write_inline(inode_map_t &map, uint32_t block, uint32_t count, const char *data);
+
+#endif /* _INODE_MAP_H_ */
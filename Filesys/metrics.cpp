@@ -0,0 +1,179 @@
+#include "metrics.h"
+
+/*
+ *  Log-linear histogram of nanosecond latencies: every power of two is split into
+ *  METRICS_SUB_BUCKETS linear buckets, so any value is recorded within 25% of its size.
+ */
+static const unsigned int METRICS_SUB_BITS = 2;
+static const unsigned int METRICS_SUB_BUCKETS = 1 << METRICS_SUB_BITS;
+static const unsigned int METRICS_BUCKETS = 64 * METRICS_SUB_BUCKETS;
+
+static const char *metric_names[METRIC_COUNT] = {
+    "read", "write", "create", "delete", "session", "readblocks", "writeblocks",
+    "lock_wait", "alloc", "disk_read", "disk_write"
+};
+
+/*
+ *  Counters of one thread.
+ *  Only the owning thread writes them, relaxed atomics let the reporter read them without a lock.
+ */
+struct metrics_histogram_t {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> allocations;      // heap allocations made inside timers, FS_COUNT_ALLOCS only
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+    std::atomic<uint64_t> buckets[METRICS_BUCKETS];
+};
+
+struct metrics_thread_t {
+    metrics_histogram_t histograms[METRIC_COUNT];
+};
+
+static std::mutex metrics_threads_lock;
+static std::vector<std::unique_ptr<metrics_thread_t>> metrics_threads;  // never shrinks, totals survive their thread
+static thread_local metrics_thread_t *local_metrics = nullptr;
+
+/*
+ *  Register the counters of the calling thread the first time it records something
+ */
+static metrics_thread_t &Local_metrics(){
+    if (local_metrics == nullptr) {
+        std::unique_ptr<metrics_thread_t> metrics(new metrics_thread_t());
+        local_metrics = metrics.get();
+        std::unique_lock<std::mutex> threads_lock(metrics_threads_lock);
+        metrics_threads.push_back(std::move(metrics));
+    }
+    return *local_metrics;
+}
+
+static unsigned int Bucket_of(uint64_t value){
+    if (value < METRICS_SUB_BUCKETS) return value;
+    unsigned int exponent = 63 - __builtin_clzll(value);
+    unsigned int sub = (value >> (exponent - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    return (exponent - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+}
+
+/*
+ *  Smallest value recorded in a bucket, used to report percentiles
+ */
+static uint64_t Bucket_floor(unsigned int bucket){
+    if (bucket < METRICS_SUB_BUCKETS) return bucket;
+    unsigned int exponent = bucket / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+    uint64_t sub = bucket % METRICS_SUB_BUCKETS;
+    return (1ULL << exponent) | (sub << (exponent - METRICS_SUB_BITS));
+}
+
+static void Relaxed_add(std::atomic<uint64_t> &counter, uint64_t value){
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+uint64_t Metrics_now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void Metrics_record(int metric, uint64_t nanoseconds){
+    metrics_histogram_t &histogram = Local_metrics().histograms[metric];
+    Relaxed_add(histogram.count, 1);
+    Relaxed_add(histogram.sum, nanoseconds);
+    if (nanoseconds > histogram.max.load(std::memory_order_relaxed)) histogram.max.store(nanoseconds, std::memory_order_relaxed);
+    Relaxed_add(histogram.buckets[Bucket_of(nanoseconds)], 1);
+}
+
+#ifdef FS_COUNT_ALLOCS
+/*
+ *  Built with -DFS_COUNT_ALLOCS, every operator new is counted for its thread, so that a timer
+ *  also reports how many heap allocations the code it measures made
+ */
+static thread_local uint64_t local_allocations = 0;
+
+void *operator new(size_t size){
+    local_allocations++;
+    void *pointer = malloc(size == 0 ? 1 : size);
+    if (pointer == nullptr) throw std::bad_alloc();
+    return pointer;
+}
+
+void operator delete(void *pointer) noexcept {
+    free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+    free(pointer);
+}
+#endif
+
+/*
+ *  Heap allocations made so far by the calling thread, always 0 without FS_COUNT_ALLOCS
+ */
+uint64_t Metrics_allocations(){
+#ifdef FS_COUNT_ALLOCS
+    return local_allocations;
+#else
+    return 0;
+#endif
+}
+
+metrics_timer_t::metrics_timer_t(int timer_metric){
+    metric = timer_metric;
+    allocations = Metrics_allocations();
+    start = Metrics_now();
+}
+
+metrics_timer_t::~metrics_timer_t(){
+    Metrics_record(metric, Metrics_now() - start);
+#ifdef FS_COUNT_ALLOCS
+    Relaxed_add(Local_metrics().histograms[metric].allocations, Metrics_allocations() - allocations);
+#endif
+}
+
+/*
+ *  Merge the histograms of every thread and print count, mean, percentiles and max in microseconds,
+ *  and with FS_COUNT_ALLOCS the mean number of heap allocations per sample
+ */
+void Metrics_print(){
+    std::vector<uint64_t> buckets(METRICS_BUCKETS);
+    std::ostringstream report;
+    std::unique_lock<std::mutex> threads_lock(metrics_threads_lock);
+    for (int metric = 0; metric < METRIC_COUNT; metric++) {
+        uint64_t count = 0, allocations = 0, sum = 0, max = 0;
+        std::fill(buckets.begin(), buckets.end(), 0);
+        for (const std::unique_ptr<metrics_thread_t> &thread_metrics : metrics_threads) {
+            const metrics_histogram_t &histogram = thread_metrics->histograms[metric];
+            count += histogram.count.load(std::memory_order_relaxed);
+            allocations += histogram.allocations.load(std::memory_order_relaxed);
+            sum += histogram.sum.load(std::memory_order_relaxed);
+            max = std::max(max, histogram.max.load(std::memory_order_relaxed));
+            for (unsigned int i = 0; i < METRICS_BUCKETS; i++) buckets[i] += histogram.buckets[i].load(std::memory_order_relaxed);
+        }
+        if (count == 0) continue;
+        /*** The bucket counts may be read slightly after count, use their own total for the percentiles ***/
+        uint64_t total = 0;
+        for (uint64_t bucket_count : buckets) total += bucket_count;
+        const double quantiles[3] = {0.5, 0.99, 0.999};
+        uint64_t percentiles[3] = {0, 0, 0};
+        for (int q = 0; q < 3; q++) {
+            uint64_t rank = (uint64_t)(quantiles[q] * total), seen = 0;
+            for (unsigned int i = 0; i < METRICS_BUCKETS; i++) {
+                seen += buckets[i];
+                if (seen > rank) {
+                    percentiles[q] = Bucket_floor(i);
+                    break;
+                }
+            }
+        }
+        report << "@@@ metric " << metric_names[metric] << " count " << count
+               << " mean_us " << sum / count / 1000.0 << " p50_us " << percentiles[0] / 1000.0
+               << " p99_us " << percentiles[1] / 1000.0 << " p999_us " << percentiles[2] / 1000.0
+               << " max_us " << max / 1000.0;
+#ifdef FS_COUNT_ALLOCS
+        report << " allocs_per_op " << (double)allocations / count;
+#endif
+        report << "\n";
+    }
+    threads_lock.unlock();
+    cout_lock.lock();
+    std::cout << report.str() << std::flush;
+    cout_lock.unlock();
+}
@@ -0,0 +1,42 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "global.h"
+
+/*
+ *  Latencies recorded by the server, each one has its own histogram
+ */
+#define METRIC_READ         0               // one histogram per request type, indexed by request_type
+#define METRIC_WRITE        1
+#define METRIC_CREATE       2
+#define METRIC_DELETE       3
+#define METRIC_SESSION      4
+#define METRIC_READBLOCKS   5
+#define METRIC_WRITEBLOCKS  6
+#define METRIC_LOCK_WAIT    7               // waits for a contended block lock stripe
+#define METRIC_ALLOC        8               // free block allocation
+#define METRIC_DISK_READ    9               // disk reads, one sample per block or per batch
+#define METRIC_DISK_WRITE   10              // disk writes, one sample per block or per batch
+#define METRIC_COUNT        11
+
+/*
+ *  Records the time from its construction to its destruction under a metric,
+ *  and the heap allocations made meanwhile when built with FS_COUNT_ALLOCS
+ */
+struct metrics_timer_t {
+    int metric;
+    uint64_t allocations;
+    uint64_t start;
+    metrics_timer_t(int timer_metric);
+    ~metrics_timer_t();
+};
+
+uint64_t Metrics_now();
+
+uint64_t Metrics_allocations();
+
+void Metrics_record(int metric, uint64_t nanoseconds);
+
+void Metrics_print();
+
+#endif /* _METRICS_H_ */
@@ -0,0 +1,118 @@
+#include "readahead.h"
+#include "cache.h"
+
+extern unsigned int readahead_max_window;
+extern const unsigned int readahead_thread_count;
+
+static const unsigned int READAHEAD_MIN_WINDOW = 4;        // window of a stream that just turned sequential
+static const unsigned int READAHEAD_MAX_STREAMS = 4096;    // the stream table is reset beyond this
+static const unsigned int READAHEAD_QUEUE_DEPTH = 64;      // pending prefetch jobs, more are dropped
+
+/*
+ *  Read pattern of one file.
+ *  Only the owner may read a file, so the inode alone identifies the (user, inode) stream.
+ */
+struct readahead_stream_t {
+    uint32_t next_block;                    // block that continues the sequential run
+    unsigned int window;                    // blocks to keep ahead of the reader, 0 for random access
+    uint32_t prefetched_until;              // file blocks before this one are already prefetched
+};
+
+struct readahead_job_t {
+    std::vector<uint32_t> blocks;           // disk blocks to load into the cache
+};
+
+static std::mutex stream_table_lock;
+static std::unordered_map<uint32_t, readahead_stream_t> stream_table;
+
+/*
+ *  Pending jobs live in a fixed ring whose block lists are reused, and the lists change hands
+ *  with swap, so once they have grown to the window size queuing a job does not allocate
+ */
+static std::mutex job_queue_lock;
+static std::condition_variable job_queue_not_empty;
+static readahead_job_t job_ring[READAHEAD_QUEUE_DEPTH];
+static unsigned int job_head = 0;           // index of the oldest pending job in job_ring
+static unsigned int job_count = 0;
+static bool job_queue_stopping = false;
+static std::vector<std::thread> readahead_threads;
+
+/*
+ *  Each readahead thread loads the blocks of one job at a time into the cache, as one batch
+ */
+static void Readahead_running(){
+    readahead_job_t job;
+    while (true) {
+        std::unique_lock<std::mutex> queue_lock(job_queue_lock);
+        while (job_count == 0 && !job_queue_stopping) job_queue_not_empty.wait(queue_lock);
+        if (job_queue_stopping) return;
+        job.blocks.swap(job_ring[job_head].blocks);
+        job_head = (job_head + 1) % READAHEAD_QUEUE_DEPTH;
+        job_count--;
+        queue_lock.unlock();
+        Cache_prefetch(job.blocks.size(), job.blocks.data());
+    }
+}
+
+void Readahead_start(){
+    if (readahead_max_window == 0) return;
+    for (unsigned int i = 0; i < readahead_thread_count; i++) {
+        readahead_threads.emplace_back(Readahead_running);
+    }
+}
+
+/*
+ *  Record a read of count blocks starting at file block "block" of the file mapped by map.
+ *  The caller holds the inode lock or validated map with an optimistic read, so the mapping is current.
+ *  A read that continues the previous one doubles the window and prefetches up to window blocks
+ *  past it, any other read halves the window and prefetches nothing.
+ *  Prefetching is only a hint: the blocks go through the cache like any other read, so a job that
+ *  runs after the file changed at worst loads a block nobody asks for.
+ */
+void Readahead_access(const inode_map_t &map, uint32_t block, uint32_t count){
+    /*** An inline file is read with its inode, there is nothing to prefetch ***/
+    if (readahead_max_window == 0 || Inode_map_inline(map)) return;
+    static thread_local readahead_job_t job;
+    {
+        std::unique_lock<std::mutex> table_lock(stream_table_lock);
+        if (stream_table.size() >= READAHEAD_MAX_STREAMS && stream_table.find(map.inode_id) == stream_table.end()) {
+            stream_table.clear();
+        }
+        auto inserted = stream_table.try_emplace(map.inode_id, readahead_stream_t{0, 0, 0});
+        readahead_stream_t &stream = inserted.first->second;
+        bool sequential = !inserted.second && block == stream.next_block;
+        stream.next_block = block + count;
+        if (!sequential) {
+            stream.window /= 2;
+            stream.prefetched_until = stream.next_block;
+            return;
+        }
+        stream.window = std::min(std::max(stream.window * 2, READAHEAD_MIN_WINDOW), readahead_max_window);
+        uint32_t first = std::max(stream.next_block, stream.prefetched_until);
+        uint32_t last = std::min(stream.next_block + stream.window, map.inode.size);
+        /*** Keep prefetching in chunks of at least half a window instead of one block per read ***/
+        if (first >= last || (last - first < stream.window / 2 && last < map.inode.size)) return;
+        job.blocks.resize(last - first);
+        Inode_map_range(map, first, last - first, job.blocks.data());
+        stream.prefetched_until = last;
+    }
+    std::unique_lock<std::mutex> queue_lock(job_queue_lock);
+    if (job_count >= READAHEAD_QUEUE_DEPTH) return;
+    job_ring[(job_head + job_count) % READAHEAD_QUEUE_DEPTH].blocks.swap(job.blocks);
+    job_count++;
+    job_queue_not_empty.notify_one();
+}
+
+/*
+ *  Stop the readahead threads, pending jobs are dropped
+ */
+void Readahead_stop(){
+    std::unique_lock<std::mutex> queue_lock(job_queue_lock);
+    job_queue_stopping = true;
+    job_queue_not_empty.notify_all();
+    queue_lock.unlock();
+    for (std::thread &readahead_thread : readahead_threads) {
+        readahead_thread.join();
+    }
+    readahead_threads.clear();
+}
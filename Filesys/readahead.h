@@ -0,0 +1,13 @@
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include "global.h"
+#include "inode_map.h"
+
+void Readahead_start();
+
+void Readahead_access(const inode_map_t &map, uint32_t block, uint32_t count);
+
+void Readahead_stop();
+
+#endif /* _READAHEAD_H_ */
@@ -2,21 +2,99 @@
 #include "helper.h"
 #include "socket.h"
 #include "filesys.h"
+#include "worker.h"
+
+/*
+ *  Upper bounds of the numeric options, larger values are clamped to them
+ */
+static const unsigned long max_worker_count = 1024;
+static const unsigned long max_request_queue_depth = 65536;
+static const unsigned long max_readahead_window = FS_MAXREQUESTBLOCKS;
+static const unsigned long max_report_interval = 86400;
+static const unsigned long max_block_stripe_count = 1 << 20;
+
+/*
+ *  Parse the decimal argument of a numeric option into value, clamped to max_value
+ *  Returns false if it is not a number or below min_value
+ */
+static bool Parse_option(const char *text, unsigned long min_value, unsigned long max_value, unsigned int &value){
+    if (text[0] < '0' || text[0] > '9') return false;
+    char *end;
+    errno = 0;
+    unsigned long number = strtoul(text, &end, 10);
+    if (*end != '\0' || number < min_value) return false;
+    if (errno == ERANGE || number > max_value) number = max_value;
+    value = number;
+    return true;
+}
   
 /*
  *  This is the main function of the server
  *  We first init the file system, and then create the server to accept client
+ *  On SIGINT/SIGTERM, the queued requests are finished and the disk is left ready for a fast restart
+ *  Usage: server [-w worker_count] [-q request_queue_depth] [-b] [-c] [-r readahead_window] [-s report_interval] [-D disk_device] [-l lock_stripes] [port]
+ *      -b  keep the free-block bitmap on disk, so a clean restart skips the tree walk
+ *      -c  write-back cache: writes complete in memory and are flushed to disk in ordered batches
+ *      -r  max blocks prefetched for sequential readers, 0 disables readahead
+ *      -s  print the cache counters and latency histograms every report_interval seconds and on exit
+ *      -D  serve the disk from this file or block device with io_uring (pread/pwrite if unavailable)
+ *          instead of disk_readblock/disk_writeblock, the disk takes the whole file or device
+ *      -l  number of stripes of the block lock table, rounded up to a power of two
+ *  worker_count, request_queue_depth and lock_stripes must be at least 1, every numeric option is
+ *  clamped to a maximum (max_ constants above) and anything that is not a decimal number is refused
  */
 int main(int argc, char *argv[])
 {
-    Filesystem_init();
+    int option;
+    unsigned int report_interval = stats_report_interval;
+    while ((option = getopt(argc, argv, "w:q:bcr:s:D:l:")) != -1) {
+        bool if_valid = true;
+        if (option == 'w') if_valid = Parse_option(optarg, 1, max_worker_count, worker_count);
+        else if (option == 'q') if_valid = Parse_option(optarg, 1, max_request_queue_depth, request_queue_depth);
+        else if (option == 'b') persistent_bitmap = true;
+        else if (option == 'c') write_back_cache = true;
+        else if (option == 'r') if_valid = Parse_option(optarg, 0, max_readahead_window, readahead_max_window);
+        else if (option == 's') if_valid = Parse_option(optarg, 0, max_report_interval, report_interval);
+        else if (option == 'D') disk_device = optarg;
+        else if (option == 'l') if_valid = Parse_option(optarg, 1, max_block_stripe_count, block_stripe_count);
+        else return 1;
+        if (!if_valid) {
+            std::cerr << "server: invalid value \"" << optarg << "\" for -" << (char)option << std::endl;
+            return 1;
+        }
+    }
+    stats_report_interval = report_interval;
     int port_number;
-    port_number = (argc == 2)?atoi(argv[1]):0;
+    port_number = (optind < argc)?atoi(argv[optind]):0;
+    /*** Block the stop signals in every thread, the event loop receives them through a signalfd ***/
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    Filesystem_init();
+    if (stats_report_interval > 0){
+        std::thread report_thread([](){
+            while (true) {
+                std::this_thread::sleep_for(std::chrono::seconds(stats_report_interval));
+                Cache_print_stats();
+                Metrics_print();
+            }
+        });
+        report_thread.detach();
+    }
     try{
         Create_server(port_number);
     }
     catch(...){
         TestPrint("Error Catched", 0);
+        return 1;
+    }
+    Worker_pool_stop();
+    Filesystem_shutdown();
+    if (stats_report_interval > 0){
+        Cache_print_stats();
+        Metrics_print();
     }
     return 0;  
 }
\ No newline at end of file
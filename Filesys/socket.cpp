@@ -1,15 +1,88 @@
 #include "socket.h"
+#include "worker.h"
 
 extern const int listen_queue_length;
 extern const int max_message_length;
 extern const int max_send_message_length;
-extern bool disk_block[FS_DISKSIZE];
-extern std::mutex disk_block_lock[FS_DISKSIZE];
-extern std::mutex free_block_lock;
 
 
+/*
+ *  Register the socket for the events the connection is ready for, the caller holds its lock.
+ *  It receives unless its requests are done or stopped, and waits to send while output is parked.
+ */
+static void Update_events(connection_t &connection){
+    if (connection.failed) return;
+    uint32_t events = 0;
+    if (!connection.read_closed && !connection.paused && !connection.waiting) events |= EPOLLIN;
+    if (!connection.output.empty()) events |= EPOLLOUT;
+    if (events == connection.events) return;
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = connection.fd;
+    epoll_ctl(connection.epoll_fd, EPOLL_CTL_MOD, connection.fd, &event);
+    connection.events = events;
+}
+
+/*
+ *  Memory held by a framed request, counted against pipeline_byte_budget
+ */
+static size_t Request_bytes(const request_t &client_request){
+    return sizeof(request_t) + client_request.blocks_data.capacity();
+}
+
+/*
+ *  Whether every request of the connection has been answered and no more will come, the caller holds its lock
+ */
+static bool Connection_done(connection_t &connection){
+    return (connection.failed || connection.read_closed) && !connection.busy
+           && connection.pending.empty() && connection.output.empty();
+}
+
+/*
+ *  Hand a connection with pending requests to the workers if none is serving it.
+ *  The loop never waits for the worker queue: when it is full, the connection stops receiving
+ *  and waits in waiting_connections, in order, until a worker makes room.
+ */
+static void Schedule_connection(std::shared_ptr<connection_t> &connection,
+                                std::deque<std::shared_ptr<connection_t>> &waiting_connections){
+    std::unique_lock<std::mutex> connection_lock(connection->lock);
+    if (connection->busy || connection->failed || connection->pending.empty() || !connection->output.empty()) return;
+    connection->busy = true;
+    if (waiting_connections.empty()) {
+        connection_lock.unlock();
+        task_t task;
+        task.connection = connection;
+        if (Worker_pool_try_push(task)) return;
+        connection_lock.lock();
+    }
+    connection->waiting = true;
+    Update_events(*connection);
+    waiting_connections.push_back(connection);
+}
+
+/*
+ *  Forget a connection, the socket is closed once the worker (if any) drops it
+ */
+static void Close_connection(std::unordered_map<int, std::shared_ptr<connection_t>> &connections, int fd){
+    auto it = connections.find(fd);
+    if (it == connections.end()) return;
+    connection_t &connection = *it->second;
+    std::unique_lock<std::mutex> connection_lock(connection.lock);
+    connection.failed = true;
+    connection.pending.clear();
+    connection.pending_bytes = 0;
+    connection.output.clear();
+    connection_lock.unlock();
+    epoll_ctl(connection.epoll_fd, EPOLL_CTL_DEL, fd, 0);
+    connections.erase(it);
+}
+
 /*  
  *  Create a server socket specificed by the port_number
+ *  A single epoll loop accepts clients, receives their requests and sends the responses the
+ *  workers could not send without blocking. Connections with framed requests are handed to
+ *  the bounded worker pool.
+ *  Returns when SIGINT or SIGTERM is received, the caller must have blocked both signals
  *  If fails, throw a SysError
  */
 void Create_server(int port_number){
@@ -36,101 +109,437 @@ void Create_server(int port_number){
     if (listen(SocketFD, listen_queue_length) == -1) {
         throw SysError("listen failed");
     }
+    if (fcntl(SocketFD, F_SETFL, fcntl(SocketFD, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        throw SysError("cannot set socket non-blocking");
+    }
+    int EpollFD = epoll_create1(0);
+    if (EpollFD == -1) {
+        throw SysError("cannot create epoll");
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = SocketFD;
+    if (epoll_ctl(EpollFD, EPOLL_CTL_ADD, SocketFD, &event) == -1) {
+        throw SysError("cannot add socket to epoll");
+    }
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    int SignalFD = signalfd(-1, &stop_signals, 0);
+    if (SignalFD == -1) {
+        throw SysError("cannot create signalfd");
+    }
+    event.events = EPOLLIN;
+    event.data.fd = SignalFD;
+    if (epoll_ctl(EpollFD, EPOLL_CTL_ADD, SignalFD, &event) == -1) {
+        throw SysError("cannot add signalfd to epoll");
+    }
+    Worker_pool_start(worker_count, request_queue_depth);
+    int RoomFD = Worker_pool_room_fd();
+    event.events = EPOLLIN;
+    event.data.fd = RoomFD;
+    if (epoll_ctl(EpollFD, EPOLL_CTL_ADD, RoomFD, &event) == -1) {
+        throw SysError("cannot add eventfd to epoll");
+    }
     cout_lock.lock();
     std::cout << "\n@@@ port " << port_number << std::endl;
     cout_lock.unlock();
+
+    /*** Connections that are not done yet indexed by socket, and those waiting for room in the worker queue ***/
+    std::unordered_map<int, std::shared_ptr<connection_t>> connections;
+    std::deque<std::shared_ptr<connection_t>> waiting_connections;
+    struct epoll_event events[listen_queue_length];
     while (true) {
-        int ConnectFD = accept(SocketFD, 0, 0);
-        if (ConnectFD == -1) {
-            throw SysError("accept failed");
+        int n = epoll_wait(EpollFD, events, listen_queue_length, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("epoll_wait failed");
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == SignalFD) {
+                /*** Stop accepting, connections still owned by workers are closed when they finish ***/
+                close(SignalFD);
+                close(EpollFD);
+                close(SocketFD);
+                return;
+            }
+            if (events[i].data.fd == SocketFD) {
+                /*** Accept every pending connection ***/
+                while (true) {
+                    int ConnectFD = accept4(SocketFD, 0, 0, SOCK_NONBLOCK);
+                    if (ConnectFD == -1) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR) break;
+                        throw SysError("accept failed");
+                    }
+                    event.events = EPOLLIN;
+                    event.data.fd = ConnectFD;
+                    if (epoll_ctl(EpollFD, EPOLL_CTL_ADD, ConnectFD, &event) == -1) {
+                        close(ConnectFD);
+                        continue;
+                    }
+                    connections[ConnectFD] = std::make_shared<connection_t>(ConnectFD, EpollFD);
+                }
+                continue;
+            }
+            if (events[i].data.fd == RoomFD) {
+                /*** Workers made room, hand over the waiting connections in order until it is full again ***/
+                uint64_t room;
+                if (read(RoomFD, &room, sizeof(room)) == -1 && errno != EAGAIN) throw SysError("eventfd read failed");
+                while (!waiting_connections.empty()) {
+                    task_t task;
+                    task.connection = waiting_connections.front();
+                    if (!Worker_pool_try_push(task)) break;
+                    std::unique_lock<std::mutex> connection_lock(waiting_connections.front()->lock);
+                    waiting_connections.front()->waiting = false;
+                    Update_events(*waiting_connections.front());
+                    connection_lock.unlock();
+                    waiting_connections.pop_front();
+                }
+                continue;
+            }
+            auto it = connections.find(events[i].data.fd);
+            if (it == connections.end()) continue;
+            std::shared_ptr<connection_t> connection = it->second;
+            /*** A worker shuts the socket down once the connection is done, or the client reset it ***/
+            bool if_open = !(events[i].events & (EPOLLERR | EPOLLHUP));
+            try{
+                if (if_open && (events[i].events & EPOLLOUT)) if_open = Flush_output(*connection);
+                if (if_open && (events[i].events & EPOLLIN)) {
+                    if (Receive_message(*connection)) Dispatch_requests(*connection);
+                    else {
+                        std::unique_lock<std::mutex> connection_lock(connection->lock);
+                        connection->read_closed = true;
+                        Update_events(*connection);
+                    }
+                }
+            }
+            catch (SysError e){
+                TestPrint("Error Catched", connection->fd);
+                if_open = false;
+            }
+            if (if_open) {
+                Schedule_connection(connection, waiting_connections);
+                std::unique_lock<std::mutex> connection_lock(connection->lock);
+                if (!Connection_done(*connection)) continue;
+            }
+            Close_connection(connections, events[i].data.fd);
         }
-        std::thread client_thread(Thread_running, ConnectFD);
-        client_thread.detach();   
     }
 }
 
 /*  
- *  Receive message from client, and parse the message into a request_t type 
+ *  Frame every complete request in the connection buffer into connection.pending.
+ *  A one-shot connection stops receiving after its first request. A persistent connection
+ *  (opened with FS_SESSION) keeps receiving until request_queue_depth of its requests wait, or
+ *  until they and the partial request hold pipeline_byte_budget bytes. At most one worker serves
+ *  them at a time so that they are processed and answered in order.
+ */
+void Dispatch_requests(connection_t &connection){
+    request_t client_request;
+    bool if_framed = true;
+    while (if_framed) {
+        if_framed = Frame_request(connection, client_request);
+        if (if_framed && client_request.request_type == SESSION) connection.persistent = true;
+        size_t request_bytes = if_framed ? Request_bytes(client_request) : 0;
+        std::unique_lock<std::mutex> connection_lock(connection.lock);
+        if (connection.failed) return;
+        if (if_framed) {
+            connection.pending.push_back(std::move(client_request));
+            connection.pending_bytes += request_bytes;
+            if (!connection.persistent) {
+                connection.read_closed = true;
+                Update_events(connection);
+                return;
+            }
+        }
+        connection.partial_bytes = connection.if_partial ? Request_bytes(connection.partial) : 0;
+        /*** Stop receiving until the worker catches up with the pipeline, it resumes once it took pending back to half ***/
+        if (!connection.paused && !connection.pending.empty()
+            && (connection.pending.size() >= request_queue_depth
+                || connection.pending_bytes + connection.partial_bytes >= pipeline_byte_budget)) {
+            connection.paused = true;
+            Update_events(connection);
+        }
+    }
+}
+
+/*  
+ *  Receive what the client has sent so far without blocking, straight into the free
+ *  tail of the connection buffer. Bytes of a partially received request are carried over
+ *  and moved to the front only when the tail runs out.
+ *  Return false if the client closed the connection or the receive fails
+ */
+bool Receive_message(connection_t &connection){
+    if (connection.buffer_begin == connection.buffer_end) {
+        connection.buffer_begin = connection.buffer_end = 0;
+    }
+    else if (connection.buffer_end == receive_buffer_size) {
+        size_t carried = connection.buffer_end - connection.buffer_begin;
+        memmove(connection.buffer, connection.buffer + connection.buffer_begin, carried);
+        connection.buffer_begin = 0;
+        connection.buffer_end = carried;
+    }
+    while (true) {
+        /*** Take at most one buffer per event, epoll reports the socket again if more is pending ***/
+        int n = recv(connection.fd, connection.buffer + connection.buffer_end, receive_buffer_size - connection.buffer_end, MSG_DONTWAIT);
+        if (n > 0) {
+            connection.buffer_end += n;
+            return true;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (n == -1 && errno == EINTR) continue;
+        return false;
+    }
+}
+
+/*  
+ *  Try to take one complete request out of the connection buffer, and parse it into a request_t type 
  *  which contains all the information about the request
+ *  The header is parsed in place as soon as its NUL arrives, or for a binary connection as soon as the
+ *  fixed header and the names it announces have arrived. The data of WRITE/WRITEBLOCKS is then
+ *  copied once, straight into the request, across as many receives as it takes.
+ *  Return false if the request is not complete yet
+ */
+bool Frame_request(connection_t &connection, request_t &client_request){
+    const char *message = connection.buffer + connection.buffer_begin;
+    size_t available = connection.buffer_end - connection.buffer_begin;
+    if (!connection.negotiated) {
+        if (available == 0) return false;
+        /*** The first byte of the connection chooses the protocol, binary connections stay open ***/
+        connection.negotiated = true;
+        connection.if_binary = ((uint8_t)message[0] == FS_BINARY_MAGIC);
+        if (connection.if_binary) connection.persistent = true;
+    }
+    if (!connection.if_partial && connection.if_binary) {
+        if (available < sizeof(fs_binary_header)) return false;
+        fs_binary_header header;
+        memcpy(&header, message, sizeof(header));
+        header.pathname_length = ntohs(header.pathname_length);
+        header.request_id = ntohl(header.request_id);
+        header.block = ntohl(header.block);
+        header.count = ntohl(header.count);
+        header.payload_length = ntohl(header.payload_length);
+        if (header.magic != FS_BINARY_MAGIC || header.pathname_length > FS_MAXPATHNAME) throw SysError("Invalid binary header");
+        size_t header_length = sizeof(header) + header.username_length + header.pathname_length;
+        if (available < header_length) return false;
+        connection.partial = Binary_Parsing(header, message + sizeof(header));
+        connection.if_partial = true;
+        connection.payload_received = 0;
+        message += header_length;
+        available -= header_length;
+        connection.buffer_begin += header_length;
+    }
+    if (!connection.if_partial) {
+        const char *header_end = (const char *)memchr(message, '\0', std::min(available, (size_t)max_message_length + 1));
+        if (header_end == NULL) {
+            if ((int)available > max_message_length) throw SysError("Message too long");
+            return false;
+        }
+        std::string_view header(message, header_end - message);
+        connection.partial = Message_Parsing(header);
+        connection.if_partial = true;
+        connection.payload_received = 0;
+        message += header.length() + 1;
+        available -= header.length() + 1;
+        connection.buffer_begin += header.length() + 1;
+    }
+    /*** If request type is WRITE/WRITEBLOCKS, we also need to receive the data ***/
+    request_t &partial = connection.partial;
+    size_t payload_length = 0;
+    if (partial.request_type == WRITE) payload_length = FS_BLOCKSIZE;
+    else if (partial.request_type == WRITEBLOCKS) payload_length = (size_t)partial.count * FS_BLOCKSIZE;
+    if (connection.payload_received < payload_length) {
+        size_t copy_length = std::min(available, payload_length - connection.payload_received);
+        if (partial.request_type == WRITE) {
+            memcpy(partial.data + connection.payload_received, message, copy_length);
+        }
+        else {
+            /*** The blocks grow with the data that arrived, a request only holds what its client has sent ***/
+            std::vector<char> &blocks_data = partial.blocks_data;
+            size_t needed = connection.payload_received + copy_length;
+            if (blocks_data.capacity() < needed) {
+                blocks_data.reserve(std::min(payload_length, std::max(needed, 2 * blocks_data.capacity())));
+            }
+            blocks_data.insert(blocks_data.end(), message, message + copy_length);
+        }
+        connection.payload_received += copy_length;
+        connection.buffer_begin += copy_length;
+        if (connection.payload_received < payload_length) return false;
+    }
+    client_request = std::move(partial);
+    connection.if_partial = false;
+    return true;
+}
+
+/*  
+ *  Append text to the header being built at position pos
+ */
+static void Append_field(char *header, size_t &pos, std::string_view field){
+    memcpy(header + pos, field.data(), field.length());
+    pos += field.length();
+}
+
+static void Append_number(char *header, size_t &pos, uint32_t number){
+    char digits[10];
+    size_t length = 0;
+    do {
+        digits[length++] = '0' + number % 10;
+        number /= 10;
+    } while (number != 0);
+    while (length > 0) header[pos++] = digits[--length];
+}
+
+/*  
+ *  Write the response header of a request into header, including its NUL terminator
+ *  Return the length of the header
+ */
+size_t Format_response_header(const request_t &client_request, char *header){
+    size_t pos = 0;
+    switch (client_request.request_type) {
+        case READ:        Append_field(header, pos, "FS_READBLOCK ");   break;
+        case WRITE:       Append_field(header, pos, "FS_WRITEBLOCK ");  break;
+        case CREATE:      Append_field(header, pos, "FS_CREATE ");      break;
+        case DELETE:      Append_field(header, pos, "FS_DELETE ");      break;
+        case READBLOCKS:  Append_field(header, pos, "FS_READBLOCKS ");  break;
+        case WRITEBLOCKS: Append_field(header, pos, "FS_WRITEBLOCKS "); break;
+        case SESSION:
+            Append_field(header, pos, "FS_SESSION");
+            header[pos++] = '\0';
+            return pos;
+        default:
+            TestPrint("---------- Invalid Request Type ---------- ", 0);
+            throw SysError("Invalid Request Type");
+    }
+    Append_field(header, pos, std::string_view(client_request.username, client_request.username_length));
+    header[pos++] = ' ';
+    Append_field(header, pos, std::string_view(client_request.pathname, client_request.pathname_length));
+    if (client_request.request_type == CREATE) {
+        header[pos++] = ' ';
+        header[pos++] = client_request.type;
+    }
+    else if (client_request.request_type != DELETE) {
+        header[pos++] = ' ';
+        Append_number(header, pos, client_request.block);
+        if (client_request.request_type == READBLOCKS || client_request.request_type == WRITEBLOCKS) {
+            header[pos++] = ' ';
+            Append_number(header, pos, client_request.count);
+        }
+    }
+    header[pos++] = '\0';
+    return pos;
+}
+
+/*  
+ *  Fill the response header of a binary request, in network byte order
+ */
+void Format_binary_response_header(const request_t &client_request, bool if_success, fs_binary_header &header){
+    memset(&header, 0, sizeof(header));
+    header.magic = FS_BINARY_MAGIC;
+    header.version = FS_BINARY_VERSION;
+    header.opcode = client_request.request_type;
+    header.status = if_success ? FS_BINARY_OK : FS_BINARY_FAILED;
+    header.request_id = htonl(client_request.request_id);
+    header.block = htonl(client_request.block);
+    header.count = htonl(client_request.count);
+    uint32_t payload_length = 0;
+    if (if_success && client_request.request_type == READ) payload_length = FS_BLOCKSIZE;
+    if (if_success && client_request.request_type == READBLOCKS) payload_length = client_request.blocks_data.size();
+    header.payload_length = htonl(payload_length);
+}
+
+/*  
+ *  Send every byte described by iov without blocking, resuming after partial writes.
+ *  What the socket does not take is copied to connection.output and sent by the event loop
+ *  on EPOLLOUT, the worker serves no further request of the connection until it is gone.
+ *  If fails, throw a SysError
+ */
+void Send_all(connection_t &connection, struct iovec *iov, int iov_count){
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = iov_count;
+    while (message.msg_iovlen > 0) {
+        ssize_t n = sendmsg(connection.fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) throw SysError("Send Fails!");
+            std::unique_lock<std::mutex> connection_lock(connection.lock);
+            for (size_t i = 0; i < message.msg_iovlen; i++) {
+                const char *base = (const char *)message.msg_iov[i].iov_base;
+                connection.output.insert(connection.output.end(), base, base + message.msg_iov[i].iov_len);
+            }
+            connection.output_sent = 0;
+            Update_events(connection);
+            return;
+        }
+        /*** Skip the fully sent buffers and move into the partially sent one ***/
+        while (message.msg_iovlen > 0 && (size_t)n >= message.msg_iov[0].iov_len) {
+            n -= message.msg_iov[0].iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0) {
+            message.msg_iov[0].iov_base = (char *)message.msg_iov[0].iov_base + n;
+            message.msg_iov[0].iov_len -= n;
+        }
+    }
+}
+
+/*
+ *  Called by the event loop on EPOLLOUT: send the parked output without blocking, and release it
+ *  once it is all sent so that the worker can serve the next request
+ *  Return false if the connection broke
  */
-request_t Receive_message(int ClientFD){
-    std::string message;
-    /*** Receive message and data from client ***/
-    while(true){
-        char buf[1];
-        buf[0] = '1';
-        int n = recv(ClientFD, buf, 1, 0); 
-        if (buf[0] == '\0') break;
-        message += buf[0];
-        if (n <= 0) throw SysError("Receive Fails! Return value <= 0");
-        if ((int)message.length() > max_message_length) throw SysError("Message too long");
-    } 
-    request_t client_request = Message_Parsing(message);
-    /*** If request type is WRITE, we also need to receive the data ***/
-    if (client_request.request_type == WRITE) {
-        memset(client_request.data, 0, FS_BLOCKSIZE);
-        int n = recv(ClientFD, client_request.data, FS_BLOCKSIZE, MSG_WAITALL);
-        if (n <= 0) throw SysError("Receive Fails! Return value <= 0");
-        else if (n < (int)FS_BLOCKSIZE) throw SysError("Receive Fails! Less than BLOCKSIZE");
-        else if (n > (int)FS_BLOCKSIZE) throw SysError("Receive Fails! More than BLOCKSIZE");
-    }
-    return client_request;
+bool Flush_output(connection_t &connection){
+    std::unique_lock<std::mutex> connection_lock(connection.lock);
+    while (connection.output_sent < connection.output.size()) {
+        ssize_t n = send(connection.fd, connection.output.data() + connection.output_sent,
+                         connection.output.size() - connection.output_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            return false;
+        }
+        connection.output_sent += n;
+    }
+    std::vector<char>().swap(connection.output);
+    connection.output_sent = 0;
+    Update_events(connection);
+    return true;
 }
 
 /*  
  *  Send back message from the server to the client
+ *  The header and the data blocks are sent straight from where they are with one sendmsg
  */
-void Send_message(int ClientFD, request_t client_request){
-    TestPrint("---------- Begin Sending Message ---------- ", ClientFD);
-    char message[max_send_message_length];
-    std::string message_str;
-    size_t length;
-
-    if (client_request.request_type == READ){
-        std::string block = std::to_string(client_request.block);
-        message_str = "FS_READBLOCK " + client_request.username + " " + client_request.pathname + " " + block;
-        length =  message_str.length() + 1;
-        strcpy(message, message_str.c_str());
-        message[length - 1] = '\0';
-        memcpy(message + length, client_request.data, FS_BLOCKSIZE);
-        length += FS_BLOCKSIZE;
-    }
-    else if (client_request.request_type == WRITE){
-        std::string block = std::to_string(client_request.block);
-        message_str = "FS_WRITEBLOCK " + client_request.username + " " + client_request.pathname + " " + block;
-        length =  message_str.length() + 1;
-        strcpy(message, message_str.c_str());
-        message[length - 1] = '\0';
-    }
-    else if (client_request.request_type == CREATE){
-        message_str = "FS_CREATE " + client_request.username + " " + client_request.pathname + " " + client_request.type;
-        length =  message_str.length() + 1;
-        strcpy(message, message_str.c_str());
-        message[length - 1] = '\0';
-    }
-    else if (client_request.request_type == DELETE){
-        message_str = "FS_DELETE " + client_request.username + " " + client_request.pathname;
-        length =  message_str.length() + 1;
-        strcpy(message, message_str.c_str());
-        message[length - 1] = '\0';
-    }
-    else {
-        TestPrint("---------- Invalid Request Type ---------- ", 0);
-        throw SysError("Invalid Request Type");
-    }
-
-    send(ClientFD, message, length, MSG_NOSIGNAL);
-    TestPrint("---------- Stop Sending Message ---------- ", ClientFD);
+void Send_message(connection_t &connection, const request_t &client_request){
+    TestPrint("---------- Begin Sending Message ---------- ", connection.fd);
+    char header[max_message_length + 1];
+    struct iovec iov[2];
+    int iov_count = 1;
+    iov[0].iov_base = header;
+    iov[0].iov_len = Format_response_header(client_request, header);
+    if (client_request.request_type == READ) {
+        iov[1].iov_base = (void *)client_request.data;
+        iov[1].iov_len = FS_BLOCKSIZE;
+        iov_count = 2;
+    }
+    else if (client_request.request_type == READBLOCKS) {
+        iov[1].iov_base = (void *)client_request.blocks_data.data();
+        iov[1].iov_len = client_request.blocks_data.size();
+        iov_count = 2;
+    }
+    Send_all(connection, iov, iov_count);
+    TestPrint("---------- Stop Sending Message ---------- ", connection.fd);
 }
 
 /*  
- *  Main thread that will handle the request from the server. 
- *  If any error is catched, we close the client socket.
+ *  Run the helper of the request type, it throws a SysError if the request fails
+ *  Either way the blocks the request freed are handed to Free_request_done
  */
-void Thread_running(int ClientFD){
-    TestPrint("---------- Thread Begin Running ---------- ", ClientFD);
+static void Serve_helpers(request_t &client_request){
     try{
-        request_t client_request = Receive_message(ClientFD);
         if (client_request.request_type == READ) {
             ReadBlock_helper(client_request);
         }
@@ -143,11 +552,116 @@ void Thread_running(int ClientFD){
         else if (client_request.request_type == DELETE) {
             Delete_helper(client_request);
         }
-        Send_message(ClientFD, client_request);
+        else if (client_request.request_type == READBLOCKS) {
+            ReadBlocks_helper(client_request);
+        }
+        else if (client_request.request_type == WRITEBLOCKS) {
+            WriteBlocks_helper(client_request);
+        }
+    }
+    catch (...){
+        Free_request_done();
+        throw;
+    }
+    /*** The writes of the request are made, the blocks it freed can be released ***/
+    Free_request_done();
+}
+
+/*  
+ *  Send back the response of a binary request, the data only if it succeeded
+ */
+void Send_binary_message(connection_t &connection, const request_t &client_request, bool if_success){
+    TestPrint("---------- Begin Sending Binary Message ---------- ", connection.fd);
+    fs_binary_header header;
+    Format_binary_response_header(client_request, if_success, header);
+    struct iovec iov[2];
+    int iov_count = 1;
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    if (if_success && client_request.request_type == READ) {
+        iov[1].iov_base = (void *)client_request.data;
+        iov[1].iov_len = FS_BLOCKSIZE;
+        iov_count = 2;
+    }
+    else if (if_success && client_request.request_type == READBLOCKS) {
+        iov[1].iov_base = (void *)client_request.blocks_data.data();
+        iov[1].iov_len = client_request.blocks_data.size();
+        iov_count = 2;
+    }
+    Send_all(connection, iov, iov_count);
+    TestPrint("---------- Stop Sending Binary Message ---------- ", connection.fd);
+}
+
+/*  
+ *  Serve one request and send back the response
+ *  If any error is catched, a text connection is closed without a response,
+ *  while a binary connection gets a FS_BINARY_FAILED response and stays open.
+ *  Return false if the connection must be closed
+ */
+bool Serve_request(connection_t &connection, request_t &client_request){
+    metrics_timer_t request_timer(client_request.request_type);
+    if (connection.if_binary) {
+        bool if_success = true;
+        try{
+            Check_Valid_Request(client_request);
+            Serve_helpers(client_request);
+        }
+        catch (...){
+            TestPrint("Error Catched", 0);
+            if_success = false;
+        }
+        try{
+            Send_binary_message(connection, client_request, if_success);
+        }
+        catch (...){
+            return false;
+        }
+        return true;
+    }
+    try{
+        Serve_helpers(client_request);
+        Send_message(connection, client_request);
     }
     catch (...){
         TestPrint("Error Catched", 0);
+        return false;
     }
-    close(ClientFD);
-    TestPrint("---------- Thread Stop Running ---------- ", ClientFD);
-}
\ No newline at end of file
+    return true;
+}
+
+/*  
+ *  Worker routine that serves the pending requests of a connection in order.
+ *  It stops at the first failure, or when a response could not be sent in full: the event loop
+ *  hands the connection to a worker again once that response is out.
+ */
+void Thread_running(task_t &task){
+    connection_t &connection = *task.connection;
+    TestPrint("---------- Thread Begin Running ---------- ", connection.fd);
+    std::unique_lock<std::mutex> connection_lock(connection.lock);
+    while (!connection.failed && connection.output.empty() && !connection.pending.empty()) {
+        request_t client_request = std::move(connection.pending.front());
+        connection.pending.pop_front();
+        connection.pending_bytes -= Request_bytes(client_request);
+        if (connection.paused && (connection.pending.empty()
+                                  || (connection.pending.size() <= request_queue_depth / 2
+                                      && connection.pending_bytes + connection.partial_bytes <= pipeline_byte_budget / 2))) {
+            connection.paused = false;
+            Update_events(connection);
+        }
+        connection_lock.unlock();
+        bool if_served = Serve_request(connection, client_request);
+        connection_lock.lock();
+        if (!if_served) {
+            /*** Drop the rest of the pipeline ***/
+            connection.failed = true;
+            connection.pending.clear();
+            connection.pending_bytes = 0;
+        }
+    }
+    connection.busy = false;
+    /*** The event loop sees the shutdown and forgets the connection ***/
+    if (Connection_done(connection)) shutdown(connection.fd, SHUT_RDWR);
+    connection_lock.unlock();
+    TestPrint("---------- Thread Stop Running ---------- ", connection.fd);
+    task.connection.reset();
+}
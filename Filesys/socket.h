@@ -5,14 +5,76 @@
 #include "helper.h"
 #include "filesys.h"
 
+/*
+ *  Size of the per-connection receive buffer, it holds several pipelined requests
+ *  and must be larger than the longest request header (max_send_message_length, or a
+ *  fs_binary_header with the longest username and pathname)
+ */
+static const unsigned int receive_buffer_size = 8192;
+
+/*
+ *  A client connection owned by the event loop, and by the worker serving its requests.
+ *  The socket is non-blocking and closed when the last owner drops it.
+ */
+struct connection_t {
+    int fd;
+    int epoll_fd;                           // epoll instance the event loop watches the socket with
+    char buffer[receive_buffer_size];       // bytes received from the client
+    size_t buffer_begin = 0;                // start of the bytes not yet framed into a request
+    size_t buffer_end = 0;                  // end of the received bytes
+    bool if_partial = false;                // true once the header of partial has been parsed
+    request_t partial;                      // request whose data is still being received
+    size_t payload_received = 0;            // bytes of the data of partial received so far
+    bool persistent = false;                // true once the client opened a session with FS_SESSION
+    bool negotiated = false;                // true once the first byte has chosen the protocol
+    bool if_binary = false;                 // true if the client speaks the binary protocol (fs_binary.h)
+    std::mutex lock;                        // protects the fields below
+    ring_queue_t<request_t> pending;        // framed requests not served yet, in the order they were sent
+    size_t pending_bytes = 0;               // memory held by the requests in pending
+    size_t partial_bytes = 0;               // memory held by partial
+    bool busy = false;                      // true while a worker task of this connection is queued or running
+    bool waiting = false;                   // true while the worker queue is full and the event loop holds the task
+    bool paused = false;                    // true while receiving is stopped because pending is too large
+    bool read_closed = false;               // true once no more request will be received
+    bool failed = false;                    // true once a request failed or the socket broke, the rest is dropped
+    std::vector<char> output;               // response bytes the socket did not take, sent on EPOLLOUT
+    size_t output_sent = 0;                 // bytes of output already sent
+    uint32_t events = EPOLLIN;              // events the socket is registered for
+    connection_t(int fd, int epoll_fd) : fd(fd), epoll_fd(epoll_fd) {}
+    ~connection_t() { close(fd); }
+};
+
+/*
+ *  A connection with pending requests handed from the event loop to a worker
+ */
+struct task_t {
+    std::shared_ptr<connection_t> connection;
+};
+
 void Create_server(int port_number);
 
-request_t Receive_message(int ClientFD);
+bool Receive_message(connection_t &connection);
+
+bool Frame_request(connection_t &connection, request_t &client_request);
+
+void Dispatch_requests(connection_t &connection);
+
+size_t Format_response_header(const request_t &client_request, char *header);
+
+void Format_binary_response_header(const request_t &client_request, bool if_success, fs_binary_header &header);
+
+void Send_all(connection_t &connection, struct iovec *iov, int iov_count);
+
+bool Flush_output(connection_t &connection);
+
+void Send_message(connection_t &connection, const request_t &client_request);
+
+void Send_binary_message(connection_t &connection, const request_t &client_request, bool if_success);
 
-void Send_message(int ClientFD, request_t client_request);
+bool Serve_request(connection_t &connection, request_t &client_request);
 
-void Thread_running(int ClientFD);
+void Thread_running(task_t &task);
 
 
 
-#endif /* _SOCKET_H_ */
\ No newline at end of file
+#endif /* _SOCKET_H_ */
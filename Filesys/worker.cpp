@@ -0,0 +1,88 @@
+#include "worker.h"
+
+/*
+ *  Bounded queue of connections with pending requests shared by the event loop and the worker threads,
+ *  its ring is sized once to the queue depth.
+ *  The event loop never waits for room: once a push failed, the next worker to take a task
+ *  makes task_queue_room_fd readable.
+ */
+static std::mutex task_queue_lock;
+static std::condition_variable task_queue_not_empty;
+static ring_queue_t<task_t> task_queue;
+static unsigned int task_queue_depth;
+static bool task_queue_stopping = false;
+static bool task_queue_was_full = false;
+static int task_queue_room_fd = -1;
+static std::vector<std::thread> worker_threads;
+
+/*
+ *  Each worker repeatedly takes one request from the queue and serves it,
+ *  until the pool is stopped and the queue is empty
+ */
+static void Worker_running(){
+    while (true) {
+        std::unique_lock<std::mutex> queue_lock(task_queue_lock);
+        while (task_queue.empty() && !task_queue_stopping) task_queue_not_empty.wait(queue_lock);
+        if (task_queue.empty()) return;
+        task_t task = std::move(task_queue.front());
+        task_queue.pop_front();
+        if (task_queue_was_full) {
+            task_queue_was_full = false;
+            uint64_t room = 1;
+            if (write(task_queue_room_fd, &room, sizeof(room)) == -1) TestPrint("---------- Room Signal Fails ---------- ", 0);
+        }
+        queue_lock.unlock();
+        Thread_running(task);
+    }
+}
+
+/*
+ *  Start a fixed number of worker threads, queue_depth bounds the number of waiting requests
+ */
+void Worker_pool_start(unsigned int thread_count, unsigned int queue_depth){
+    if (thread_count == 0 || queue_depth == 0) throw SysError("Invalid worker pool size");
+    task_queue_depth = queue_depth;
+    task_queue = ring_queue_t<task_t>(queue_depth);
+    task_queue_room_fd = eventfd(0, EFD_NONBLOCK);
+    if (task_queue_room_fd == -1) throw SysError("cannot create eventfd");
+    for (unsigned int i = 0; i < thread_count; i++) {
+        worker_threads.emplace_back(Worker_running);
+    }
+}
+
+/*
+ *  Let the workers finish every queued request, then wait for them to exit
+ */
+void Worker_pool_stop(){
+    std::unique_lock<std::mutex> queue_lock(task_queue_lock);
+    task_queue_stopping = true;
+    task_queue_not_empty.notify_all();
+    queue_lock.unlock();
+    for (std::thread &worker_thread : worker_threads) {
+        worker_thread.join();
+    }
+    worker_threads.clear();
+    close(task_queue_room_fd);
+}
+
+/*
+ *  Hand a connection to the workers without waiting
+ *  Return false if the queue is full, Worker_pool_room_fd becomes readable once there is room
+ */
+bool Worker_pool_try_push(task_t &task){
+    std::unique_lock<std::mutex> queue_lock(task_queue_lock);
+    if (task_queue.size() >= task_queue_depth) {
+        task_queue_was_full = true;
+        return false;
+    }
+    task_queue.push_back(std::move(task));
+    task_queue_not_empty.notify_one();
+    return true;
+}
+
+/*
+ *  eventfd the event loop watches to retry the pushes that found the queue full, it must read it to rearm it
+ */
+int Worker_pool_room_fd(){
+    return task_queue_room_fd;
+}
@@ -0,0 +1,15 @@
+#ifndef _WORKER_H_
+#define _WORKER_H_
+
+#include "global.h"
+#include "socket.h"
+
+void Worker_pool_start(unsigned int thread_count, unsigned int queue_depth);
+
+bool Worker_pool_try_push(task_t &task);
+
+int Worker_pool_room_fd();
+
+void Worker_pool_stop();
+
+#endif /* _WORKER_H_ */